@@ -28,8 +28,10 @@
 #include <ctype.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <limits.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
@@ -38,21 +40,61 @@
 #include <grp.h>
 #include "dsbcfg.h"
 
-static int	write_var(dsbcfg_var_t *, FILE *);
-static int	parse_line(char *, dsbcfg_vardef_t *, int, dsbcfg_var_t *);
-static int	var_set_defaults(dsbcfg_var_t *, dsbcfg_vardef_t *, int);
-static int	open_cfg_file(const char *, const char *);
+#ifdef WITH_USDT
+# include <sys/sdt.h>
+#else
+# define DTRACE_PROBE1(p, n, a)
+# define DTRACE_PROBE2(p, n, a, b)
+#endif
+
+struct outbuf_s;
+
+static int	file_hash(dsbcfg_parser_t *, const char *, size_t *,
+		    uint64_t *);
+static int	serialize(const dsbcfg_t *, struct outbuf_s *);
+static int	buf_putvar(struct outbuf_s *, const dsbcfg_var_t *);
+static int	buf_grow(struct outbuf_s *, size_t);
+static int	buf_puts(struct outbuf_s *, const char *);
+static int	buf_putquoted(struct outbuf_s *, const char *);
+static int	sync_dir(dsbcfg_parser_t *, const char *);
+static int	write_cfg(dsbcfg_parser_t *, const char *, const char *,
+		    const dsbcfg_t *);
+static void	stamp_read(dsbcfg_parser_t *, int, const char *,
+		    const struct stat *, size_t, uint64_t);
+static void	set_stamp(dsbcfg_parser_t *, const char *, const struct stat *,
+		    size_t, uint64_t);
+static uint64_t	hash_buf(const char *, size_t);
+static int	parse_line(dsbcfg_parser_t *, char *, dsbcfg_vardef_t *, int,
+		    dsbcfg_var_t *);
+static int	var_set_defaults(dsbcfg_parser_t *, dsbcfg_var_t *,
+		    dsbcfg_vardef_t *, int);
+static int	open_cfg_file(dsbcfg_parser_t *, const char *, const char *);
 static bool	is_label(const char *);
-static char	*readln(void);
-static char	*cfgpath(const char *, const char *);
-static char	*cutok(char *, bool *);
-static char	*escape_str(const char *);
-static char	*strdupstrcat(char **, char *);
-static char	**add_string(char ***, const char *);
-static void	close_cfg_file(void);
-static void	seterr(int, const char *, ...);
+static bool	var_equals(const dsbcfg_var_t *, dsbcfg_val_t);
+static char	*readln(dsbcfg_parser_t *);
+static int	homedir(dsbcfg_parser_t *, char *, size_t);
+static char	*cfgpath(dsbcfg_parser_t *, const char *, const char *);
+static char	*cutok(dsbcfg_parser_t *, char *, bool *);
+static char	*strdupstrcat(dsbcfg_parser_t *, char **, char *);
+static char	**add_string(dsbcfg_parser_t *, char ***, const char *);
+static void	close_cfg_file(dsbcfg_parser_t *);
+static void	seterr(dsbcfg_parser_t *, int, const char *, ...);
 static void	free_node(dsbcfg_t *);
-static dsbcfg_t	*new_config_node(int);
+static void	unlink_node(dsbcfg_t **, dsbcfg_t *);
+static void	index_del(struct dsbcfg_index_s *, dsbcfg_t *);
+static void	index_free(struct dsbcfg_index_s *);
+static int	init_root(dsbcfg_parser_t *, dsbcfg_t *);
+static int	append_node(dsbcfg_parser_t *, dsbcfg_t *, dsbcfg_t *);
+static int	index_add(dsbcfg_parser_t *, struct dsbcfg_index_s *,
+		    dsbcfg_t *);
+static int	index_grow(dsbcfg_parser_t *, struct dsbcfg_index_s *);
+static int	find_vardef(dsbcfg_parser_t *, const dsbcfg_vardef_t *, int,
+		    const char *);
+static uint32_t	hash_str(const char *);
+static dsbcfg_t	*new_config_node(dsbcfg_parser_t *, int);
+static dsbcfg_t	*rootnode(dsbcfg_t *);
+static dsbcfg_t	*index_lookup(const struct dsbcfg_index_s *, const char *);
+static dsbcfg_t	**index_slot(const struct dsbcfg_index_s *, const char *);
 
 #define NERRCODES (sizeof(errtbl) / sizeof(errtbl[0]))
 
@@ -70,125 +112,215 @@ static struct errtbl_s {
 	{ DSBCFG_ERR_DUPLICATED,   "Duplicated config file section" }
 };
 
-static struct error_s {
+#define CFG_PATH_MAX (_POSIX_PATH_MAX * 3)
+
+struct error_s {
 	int  lineno;			 /* Current line number. */
 	int  errcode;			 /* error code for error table. */
 	int  _errno;			 /* Saved errno. */
 	char prfx[1024];		 /* function name/message. */
 	char *file;
-} _error;
+};
 
-static struct parser_s {
-	int  lineno;			 /* Current line number. */
-	int  bufsz;			 /* Total capacity of lnbuf */
-	int  rd;			 /* # of bytes in lnbuf */
-	int  slen;			 /* Length of next to return str. */
-	bool needline;
-	char file[_POSIX_PATH_MAX * 3];	 /* File name . */
-	char *lnbuf;			 /* Line buffer for readln(). */
-	char *pbuf;
-	FILE *fp;
-} parser;
+struct parser_s {
+	int    lineno;			 /* Current line number. */
+	bool   needline;
+	char   file[CFG_PATH_MAX];	 /* File name . */
+	char   *lnbuf;			 /* File contents for readln(). */
+	char   *pbuf;
+	char   *tokstart;		 /* Next token for cutok(). */
+	FILE   *fp;
+	size_t bufsz;			 /* Total capacity of lnbuf */
+	size_t len;			 /* # of bytes in lnbuf */
+	size_t pos;			 /* Offset of the next line. */
+};
+
+/*
+ * Status and content hash of the config file read or written last. They
+ * let dsbcfg_write() skip writes that wouldn't change the file.
+ */
+struct stamp_s {
+	char	 file[CFG_PATH_MAX];
+	dev_t	 dev;
+	ino_t	 ino;
+	time_t	 mtime;
+	size_t	 size;
+	uint64_t hash;
+};
+
+/*
+ * Buffer the config is serialized into by dsbcfg_write().
+ */
+struct outbuf_s {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+	dsbcfg_parser_t *ctx;		 /* For error reporting. */
+};
+
+/*
+ * Open addressing hash table of the section labels. It is attached to
+ * the first node of a config.
+ */
+#define INDEX_MINSIZE 16
+struct dsbcfg_index_s {
+	size_t	 size;			 /* # of slots, a power of 2. */
+	size_t	 used;			 /* # of used and deleted slots. */
+	size_t	 count;			 /* # of labeled sections. */
+	dsbcfg_t *global;		 /* Unlabeled section or NULL. */
+	dsbcfg_t *tail;			 /* Last section. */
+	dsbcfg_t **slots;
+};
+static dsbcfg_t deleted_slot;
+#define SLOT_DELETED (&deleted_slot)
+
+/*
+ * Hash tables of the variable names of vardefs tables. They are built
+ * on first use, and kept until the context is freed.
+ */
+struct varindex_s {
+	int		      nvardefs;
+	int		      *slots;	 /* Index into vardefs + 1, or 0. */
+	size_t		      size;	 /* # of slots, a power of 2. */
+	const dsbcfg_vardef_t *vardefs;
+	struct varindex_s     *next;
+};
+
+/*
+ * Parser context. It holds all state of reading and writing config files,
+ * so that different threads can use different contexts at the same time.
+ * The functions without the _r suffix use the default context.
+ */
+struct dsbcfg_parser_s {
+	int		  syncmode;	 /* See dsbcfg_setsync(). */
+	char		  strbuf[2048];	 /* Message of dsbcfg_strerror(). */
+	struct error_s	  error;
+	struct parser_s	  parser;
+	struct stamp_s	  stamp;
+	struct varindex_s *varindexes;
+};
+
+static dsbcfg_parser_t defctx = {
+	.syncmode = DSBCFG_SYNC_FILE, .error.errcode = -1
+};
 
 void
 dsbcfg_printerr()
+{
+	dsbcfg_printerr_r(&defctx);
+}
+
+void
+dsbcfg_printerr_r(dsbcfg_parser_t *ctx)
 {
 	unsigned int i;
 
-	if (_error.errcode == -1)
+	if (ctx->error.errcode == -1)
 		return;
-	for (i = 0; i < NERRCODES && errtbl[i].code != _error.errcode; i++)
+	for (i = 0; i < NERRCODES && errtbl[i].code != ctx->error.errcode; i++)
 		;
 	if (i == NERRCODES)
 		warnx("Unknown error code");
 	else {
-		if (_error.errcode & DSBCFG_ERR_SYNTAX_ERROR)
+		if (ctx->error.errcode & DSBCFG_ERR_SYNTAX_ERROR)
 			(void)fprintf(stderr, "Syntax error: ");
-		else if (_error.errcode == DSBCFG_ERR_SYS_ERROR &&
-		    _error._errno != ENOENT)
+		else if (ctx->error.errcode == DSBCFG_ERR_SYS_ERROR &&
+		    ctx->error._errno != ENOENT)
 			(void)fprintf(stderr, "Fatal: ");
-		if (_error.prfx[0] != '\0')
-			(void)fprintf(stderr, "%s: ", _error.prfx);
+		if (ctx->error.prfx[0] != '\0')
+			(void)fprintf(stderr, "%s: ", ctx->error.prfx);
 		(void)fprintf(stderr, "%s", errtbl[i].msg);
-		if (_error.errcode == DSBCFG_ERR_SYS_ERROR) {
+		if (ctx->error.errcode == DSBCFG_ERR_SYS_ERROR) {
 			(void)fprintf(stderr, ": %s\n",
-			    strerror(_error._errno));
-			errno = _error._errno;
+			    strerror(ctx->error._errno));
+			errno = ctx->error._errno;
 			/* Not config file related, so return here. */
 			return;
-		} else if (_error.lineno > 0) {
+		} else if (ctx->error.lineno > 0) {
 			(void)fprintf(stderr, ", in file %s, line %d\n",
-			    _error.file, _error.lineno);
+			    ctx->error.file, ctx->error.lineno);
 		} else
 			(void)fprintf(stderr, "\n");
 	}
-	errno = _error._errno;
+	errno = ctx->error._errno;
 }
 
 const char *
 dsbcfg_strerror()
+{
+	return (dsbcfg_strerror_r(&defctx));
+}
+
+/*
+ * Returns the message of the last error of the given context. The string
+ * is valid until the next call with the same context.
+ */
+const char *
+dsbcfg_strerror_r(dsbcfg_parser_t *ctx)
 {
 	unsigned int i;
-	static char strbuf[1024 + sizeof(_error.prfx)], *p;
-	
-	p = strbuf; *p = '\0';
-	if (_error.errcode == -1)
+	char	     *strbuf, *p;
+	const size_t strbufsz = sizeof(ctx->strbuf);
+
+	p = strbuf = ctx->strbuf; *p = '\0';
+	if (ctx->error.errcode == -1)
 		return (strbuf);
-	for (i = 0; i < NERRCODES && errtbl[i].code != _error.errcode; i++)
+	for (i = 0; i < NERRCODES && errtbl[i].code != ctx->error.errcode; i++)
 		;
 	if (i == NERRCODES)
-		return (strncpy(strbuf, "Unknown error code", sizeof(strbuf)));
+		return (strncpy(strbuf, "Unknown error code", strbufsz));
 	else {
-		if (_error.errcode & DSBCFG_ERR_SYNTAX_ERROR) {
-			(void)snprintf(p, sizeof(strbuf) - strlen(p) - 1,
+		if (ctx->error.errcode & DSBCFG_ERR_SYNTAX_ERROR) {
+			(void)snprintf(p, strbufsz - strlen(p) - 1,
 			    "Syntax error: ");
-		} else if (_error.errcode == DSBCFG_ERR_SYS_ERROR &&
-		    _error._errno != ENOENT) {
-			(void)snprintf(p, sizeof(strbuf) - strlen(p) - 1,
+		} else if (ctx->error.errcode == DSBCFG_ERR_SYS_ERROR &&
+		    ctx->error._errno != ENOENT) {
+			(void)snprintf(p, strbufsz - strlen(p) - 1,
 			    "Fatal: ");
 		}
-		if (_error.prfx[0] != '\0') {
+		if (ctx->error.prfx[0] != '\0') {
 			(void)snprintf(p + strlen(p),
-			    sizeof(strbuf) - strlen(p) - 1,
-			    "%s: ", _error.prfx);
+			    strbufsz - strlen(p) - 1,
+			    "%s: ", ctx->error.prfx);
 		}
-		(void)snprintf(p + strlen(p), sizeof(strbuf) - strlen(p) - 1,
+		(void)snprintf(p + strlen(p), strbufsz - strlen(p) - 1,
 		    "%s", errtbl[i].msg);
-		if (_error.errcode == DSBCFG_ERR_SYS_ERROR) {
+		if (ctx->error.errcode == DSBCFG_ERR_SYS_ERROR) {
 			(void)snprintf(p + strlen(p),
-			    sizeof(strbuf) - strlen(p) - 1, ": %s\n",
-			    strerror(_error._errno));
-			errno = _error._errno;
+			    strbufsz - strlen(p) - 1, ": %s\n",
+			    strerror(ctx->error._errno));
+			errno = ctx->error._errno;
 			/* Not config file related, so return here. */
 			return (strbuf);
-		} else if (_error.lineno > 0) {
+		} else if (ctx->error.lineno > 0) {
 			(void)snprintf(p + strlen(p),
-			    sizeof(strbuf) - strlen(p) - 1,
-			    ", in file %s, line %d\n", _error.file,
-			    _error.lineno);
+			    strbufsz - strlen(p) - 1,
+			    ", in file %s, line %d\n", ctx->error.file,
+			    ctx->error.lineno);
 		} else
 			(void)snprintf(p + strlen(p),
-			    sizeof(strbuf) - strlen(p) - 1, "\n");
+			    strbufsz - strlen(p) - 1, "\n");
 	}
-	errno = _error._errno;
+	errno = ctx->error._errno;
 
 	return (strbuf);
 }
 
 static void
-seterr(int errcode, const char *msg, ...)
+seterr(dsbcfg_parser_t *ctx, int errcode, const char *msg, ...)
 {
 	va_list ap;
 
-	_error.file    = parser.file;
-	_error.lineno  = parser.lineno;
-	_error._errno  = errno;
-	_error.errcode = errcode;
-	_error.prfx[0] = '\0';
+	ctx->error.file    = ctx->parser.file;
+	ctx->error.lineno  = ctx->parser.lineno;
+	ctx->error._errno  = errno;
+	ctx->error.errcode = errcode;
+	ctx->error.prfx[0] = '\0';
 
 	if (msg != NULL) {
 		va_start(ap, msg);
-		(void)vsnprintf(_error.prfx, sizeof(_error.prfx), msg, ap);
+		(void)vsnprintf(ctx->error.prfx, sizeof(ctx->error.prfx), msg,
+		    ap);
 	}
 }
 
@@ -198,25 +330,27 @@ seterr(int errcode, const char *msg, ...)
  */
 char *
 dsbcfg_mkdir(const char *dir)
+{
+	return (dsbcfg_mkdir_r(&defctx, dir));
+}
+
+char *
+dsbcfg_mkdir_r(dsbcfg_parser_t *ctx, const char *dir)
 {
 	int	      len;
-	char	      *path, *p, *q;
+	char	      *path, *p, *q, home[CFG_PATH_MAX];
 	struct stat   sb;
-	struct passwd *pw;
 
-	if ((pw = getpwuid(getuid())) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR,
-		    "Couldn't find you in the password file");
+	if (homedir(ctx, home, sizeof(home)) == -1)
 		return (NULL);
-        }
-	endpwent();
-
-	len = sizeof(PATH_DSB_CFG_DIR) + strlen(pw->pw_dir) + 4;
+	len = sizeof(PATH_DSB_CFG_DIR) + strlen(home) + 4;
 	if (dir != NULL)
 		len += strlen(dir);
-	if ((path = malloc(len)) == NULL)
+	if ((path = malloc(len)) == NULL) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "malloc()");
 		return (NULL);
-	(void)snprintf(path, len, "%s/", pw->pw_dir);
+	}
+	(void)snprintf(path, len, "%s/", home);
 	for (p = PATH_DSB_CFG_DIR, q = path + strlen(path); *p != '\0';) {
 		while (*p != '\0' && *p != '/')
 			*q++ = *p++;
@@ -225,11 +359,11 @@ dsbcfg_mkdir(const char *dir)
 		*q++ = '/'; *q = '\0';
 		if (stat(path, &sb) == -1) {
 			if (errno != ENOENT) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "stat()");
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "stat()");
 				return (NULL);
 			}
 			if (mkdir(path, S_IRWXU) == -1) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "mkdir()");
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "mkdir()");
 				return (NULL);
 			}
 		}
@@ -238,11 +372,11 @@ dsbcfg_mkdir(const char *dir)
 		(void)strncat(path, dir, len - strlen(path) - 1);
 		if (stat(path, &sb) == -1) {
 			if (errno != ENOENT) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "stat()");
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "stat()");
 				return (NULL);
 			}
 			if (mkdir(path, S_IRWXU) == -1) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "mkdir()");
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "mkdir()");
 				return (NULL);
 			}
 		}
@@ -260,125 +394,152 @@ dsbcfg_mkdir(const char *dir)
  * <config base dir>/<file> if subdir == NULL.
  */
 static char *
-cfgpath(const char *subdir, const char *file)
+cfgpath(dsbcfg_parser_t *ctx, const char *subdir, const char *file)
 {
-	struct passwd *pw;
-	
-	if (*file != '/') {
-		if ((pw = getpwuid(getuid())) == NULL) {
-			seterr(DSBCFG_ERR_SYS_ERROR,
-			    "Couldn't find you in the password file");
-			return (NULL);
-		}
-		endpwent();
-	}
+	char home[CFG_PATH_MAX];
+
+	if (*file != '/' && homedir(ctx, home, sizeof(home)) == -1)
+		return (NULL);
 	if (strlen(subdir != NULL ? subdir : "") + strlen(file) +
-	    (*file != '/' ? strlen(PATH_DSB_CFG_DIR) : 0)       +
-	    4 > sizeof(parser.file)) {
-		seterr(DSBCFG_ERR_PATH_EXCEED, NULL);
+	    (*file != '/' ? strlen(PATH_DSB_CFG_DIR) + strlen(home) : 0) +
+	    4 > CFG_PATH_MAX) {
+		seterr(ctx, DSBCFG_ERR_PATH_EXCEED, NULL);
 		return (NULL);
 	}
 	if (*file != '/') {
-		(void)snprintf(parser.file, sizeof(parser.file),
-		    subdir != NULL ? "%s/%s/%s/%s" : "%s/%s%s/%s", pw->pw_dir,
+		(void)snprintf(ctx->parser.file, CFG_PATH_MAX,
+		    subdir != NULL ? "%s/%s/%s/%s" : "%s/%s%s/%s", home,
 		    PATH_DSB_CFG_DIR, subdir != NULL ? subdir : "", file);
 	} else
-		(void)strncpy(parser.file, file, sizeof(parser.file));
-	return (parser.file);
+		(void)strncpy(ctx->parser.file, file, CFG_PATH_MAX);
+	return (ctx->parser.file);
+}
+
+/*
+ * Copies the user's home directory to 'dir'. getpwuid_r() is used, since
+ * getpwuid() returns a pointer to static storage.
+ */
+static int
+homedir(dsbcfg_parser_t *ctx, char *dir, size_t size)
+{
+	int	      error;
+	long	      bufsz;
+	char	      *buf;
+	struct passwd pwd, *pw;
+
+	if ((bufsz = sysconf(_SC_GETPW_R_SIZE_MAX)) == -1)
+		bufsz = 4096;
+	if ((buf = malloc(bufsz)) == NULL) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "malloc()");
+		return (-1);
+	}
+	if ((error = getpwuid_r(getuid(), &pwd, buf, bufsz, &pw)) != 0 ||
+	    pw == NULL) {
+		errno = error;
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR,
+		    "Couldn't find you in the password file");
+		free(buf);
+		return (-1);
+	}
+	if (strlen(pw->pw_dir) >= size) {
+		seterr(ctx, DSBCFG_ERR_PATH_EXCEED, NULL);
+		free(buf);
+		return (-1);
+	}
+	(void)strcpy(dir, pw->pw_dir);
+	free(buf);
+
+	return (0);
 }
 
 dsbcfg_t *
 dsbcfg_read(const char *subdir, const char *file, dsbcfg_vardef_t *vardefs,
 	    int nvardefs)
+{
+	return (dsbcfg_read_r(&defctx, subdir, file, vardefs, nvardefs));
+}
+
+dsbcfg_t *
+dsbcfg_read_r(dsbcfg_parser_t *ctx, const char *subdir, const char *file,
+	      dsbcfg_vardef_t *vardefs, int nvardefs)
 {
 	char	 *ln;
-	dsbcfg_t *cfg, *cp;
+	dsbcfg_t *cfg, *cp, *np;
 
 	errno = 0; cfg = NULL;
-	if (open_cfg_file(subdir, file) == -1)
+	if (open_cfg_file(ctx, subdir, file) == -1)
 		return (NULL);
 	/*
-	 * Get all global variables, that is, variables before
-	 * the first labeled block.
+	 * The first node always holds the global variables, that is,
+	 * variables before the first labeled block, even if there are
+	 * none.
 	 */
-	while ((ln = readln()) != NULL && !is_label(ln)) {
+	if ((cfg = new_config_node(ctx, nvardefs)) == NULL)
+		goto error;
+	if (var_set_defaults(ctx, cfg->vars, vardefs, nvardefs) == -1 ||
+	    init_root(ctx, cfg) == -1)
+		goto error;
+	cp = cfg;
+	while ((ln = readln(ctx)) != NULL && !is_label(ln)) {
 		while (isspace(*ln))
 			ln++;
 		if (!*ln || *ln == '#')
 			continue;
-		if (cfg == NULL) {
-			cp = cfg = new_config_node(nvardefs);
-			if (cfg == NULL)
-				goto error;
-			if (var_set_defaults(cp->vars, vardefs, nvardefs) == -1)
-				return (NULL);
-		}
-		(void)strtok(ln, "\n");
-		if (parse_line(ln, vardefs, nvardefs, cp->vars) == -1)
+		ln[strcspn(ln, "\n")] = '\0';
+		if (parse_line(ctx, ln, vardefs, nvardefs, cp->vars) == -1)
 			goto error;
 	}
-	if (ln == NULL) {
-		if (cfg == NULL) {
-			/* Empty config file. */
-			if ((cfg = new_config_node(nvardefs)) == NULL)
-				goto error;
-			if (var_set_defaults(cfg->vars, vardefs,
-			    nvardefs) == -1)
-				return (NULL);
-		}
- 		close_cfg_file(); return (cfg);
-	}
-	for (; ln != NULL; ln = readln()) {
+	for (; ln != NULL; ln = readln(ctx)) {
 		if (is_label(ln)) {
-			(void)strtok(ln, ":");
-			if (cfg != NULL && dsbcfg_getnode(cfg, ln) != NULL) {
-				seterr(DSBCFG_ERR_DUPLICATED,
+			ln[strcspn(ln, ":")] = '\0';
+			if (dsbcfg_getnode(cfg, ln) != NULL) {
+				seterr(ctx, DSBCFG_ERR_DUPLICATED,
 				    "Section '%s'", ln);
 				goto error;
 			}
-			if (cfg != NULL) {
-				cp->next = new_config_node(nvardefs);
-				if (cp->next == NULL)
-					goto error;
-				cp = cp->next;
-			} else {
-				if ((cfg = new_config_node(nvardefs)) == NULL)
-					goto error;
-				cp = cfg;
+			if ((np = new_config_node(ctx, nvardefs)) == NULL)
+				goto error;
+			if ((np->label = strdup(ln)) == NULL) {
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
+				free_node(np);
+				goto error;
 			}
-			if ((cp->label = strdup(ln)) == NULL) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+			if (var_set_defaults(ctx, np->vars, vardefs,
+			    nvardefs) == -1 ||
+			    append_node(ctx, cfg, np) == -1) {
+				free_node(np);
 				goto error;
 			}
-			if (var_set_defaults(cp->vars, vardefs, nvardefs) == -1)
-				return (NULL);
+			cp = np;
 		} else {
-			(void)strtok(ln, "\n");
-			if (parse_line(ln, vardefs, nvardefs, cp->vars) == -1)
+			ln[strcspn(ln, "\n")] = '\0';
+			if (parse_line(ctx, ln, vardefs, nvardefs,
+			    cp->vars) == -1)
 				goto error;
 		}
 	}
-	close_cfg_file();
+	close_cfg_file(ctx);
 	return (cfg);
 error:
-	dsbcfg_free(cfg); close_cfg_file();
+	dsbcfg_free(cfg); close_cfg_file(ctx);
 	return (NULL);
 }
 
 char **
 dsbcfg_list_to_strings(const char *str, bool *error)
 {
-	char *buf, *p, **v;
+	char		*buf, *p, **v;
+	dsbcfg_parser_t *ctx = &defctx;
 
 	*error = false;
 	if (str == NULL)
 		return (NULL);
 	if ((buf = strdup(str)) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
 		return (NULL);
 	}
-	for (v = NULL, p = buf; (p = cutok(p, error)) != NULL; p = NULL) {
-		if (add_string(&v, p) == NULL) {
+	for (v = NULL, p = buf; (p = cutok(ctx, p, error)) != NULL; p = NULL) {
+		if (add_string(ctx, &v, p) == NULL) {
 			free(buf); free(v);
 			return (NULL);
 		}
@@ -390,18 +551,22 @@ dsbcfg_list_to_strings(const char *str, bool *error)
 dsbcfg_t *
 dsbcfg_new(const char *label, dsbcfg_vardef_t *vardefs, int nvardefs)
 {
-	dsbcfg_t *cfg;
+	dsbcfg_t	*cfg;
+	dsbcfg_parser_t *ctx = &defctx;
 
-	if ((cfg = new_config_node(nvardefs)) == NULL)
+	if ((cfg = new_config_node(ctx, nvardefs)) == NULL)
 		goto error;
 	if (label != NULL) {
 		if ((cfg->label = strdup(label)) == NULL) {
-			seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
 			goto error;
 		}
 	}
-	if (var_set_defaults(cfg->vars, vardefs, nvardefs) == -1)
+	if (var_set_defaults(ctx, cfg->vars, vardefs, nvardefs) == -1 ||
+	    init_root(ctx, cfg) == -1)
 		goto error;
+	/* New config, not yet written. */
+	cfg->dirty = true;
 	return (cfg);
 error:
 	dsbcfg_free(cfg);
@@ -411,30 +576,26 @@ error:
 void
 dsbcfg_delnode(dsbcfg_t **cfg, const char *label)
 {
-	dsbcfg_t *cp, *prev;
-	
-	if (label == NULL) {
-		if ((*cfg)->label != NULL)
-			return;
-		cp = (*cfg)->next, free_node(*cfg), *cfg = cp;
+	dsbcfg_t *cp;
+
+	if (*cfg == NULL)
 		return;
-	}
-	for (cp = prev = *cfg; cp != NULL; cp = cp->next) {
-		if (cp->label != NULL && !strcmp(cp->label, label)) {
-			prev->next = cp->next, free_node(cp);
-			return;
-		} else
-			prev = cp;
-	}
+	if (label == NULL && (*cfg)->label != NULL)
+		return;
+	if ((cp = dsbcfg_getnode(*cfg, label)) != NULL)
+		unlink_node(cfg, cp);
 }
 
 dsbcfg_t *
 dsbcfg_getnode(dsbcfg_t *cfg, const char *label)
 {
+	if (cfg != NULL && (cfg = rootnode(cfg))->index != NULL)
+		return (index_lookup(cfg->index, label));
 	for (; cfg != NULL; cfg = cfg->next) {
 		if (label == NULL && cfg->label == NULL)
 			return (cfg);
-		if (cfg->label != NULL && !strcmp(cfg->label, label))
+		if (cfg->label != NULL && label != NULL &&
+		    !strcmp(cfg->label, label))
 			return (cfg);
 	}
 	return (NULL);
@@ -445,6 +606,8 @@ dsbcfg_free(dsbcfg_t *cfg)
 {
 	dsbcfg_t *cp, *next;
 
+	if (cfg != NULL)
+		index_free(cfg->index);
 	for (cp = cfg; cp != NULL; cp = next)
 		next = cp->next, free_node(cp);
 }
@@ -472,39 +635,51 @@ dsbcfg_t *
 dsbcfg_addnode(dsbcfg_t *cfg, const char *label, dsbcfg_vardef_t *vardefs,
 	       int ndefs)
 {
-	dsbcfg_t *cp;
+	dsbcfg_t	*cp;
+	dsbcfg_parser_t *ctx = &defctx;
 
 	if (dsbcfg_getnode(cfg, label) != NULL) {
-		seterr(DSBCFG_ERR_DUPLICATED,
+		seterr(ctx, DSBCFG_ERR_DUPLICATED,
 		    label == NULL ? "Global section%s" : "Section '%s'",
 		    label == NULL ? "" : label);
 		return (NULL);
 	}
-	for (cp = cfg; cp != NULL && cp->next != NULL; cp = cp->next)
-		;
-	if (cp == NULL)
-		return (NULL);
-	if ((cp->next = new_config_node(ndefs)) == NULL)
+	if (cfg == NULL || (cp = new_config_node(ctx, ndefs)) == NULL)
 		return (NULL);
-	cp = cp->next;
 	if ((cp->label = strdup(label)) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
+		free_node(cp);
 		return (NULL);
 	}
-	if (var_set_defaults(cp->vars, vardefs, ndefs) == -1)
+	if (var_set_defaults(ctx, cp->vars, vardefs, ndefs) == -1 ||
+	    append_node(ctx, rootnode(cfg), cp) == -1) {
+		free_node(cp);
 		return (NULL);
+	}
+	cp->dirty = true;
 	return (cp);
 }
 
+/*
+ * Sets the value of the given variable. The node is only marked as dirty
+ * if the value actually changed.
+ */
 int
 dsbcfg_setval(dsbcfg_t *node, int vid, dsbcfg_val_t val)
 {
-	char **pp;
+	char		**pp;
+	dsbcfg_parser_t *ctx = &defctx;
 
+	if (node->vars[vid].set && var_equals(&node->vars[vid], val))
+		return (0);
+	node->dirty = node->vars[vid].set = node->vars[vid].dirty = true;
 	if (node->vars[vid].type == DSBCFG_VAR_STRING) {
 		free(node->vars[vid].val.string);
+		node->vars[vid].val.string = NULL;
+		if (val.string == NULL)
+			return (0);
 		if ((node->vars[vid].val.string = strdup(val.string)) == NULL) {
-			seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
 			return (-1);
 		}
 	} else if (node->vars[vid].type == DSBCFG_VAR_STRINGS) {
@@ -514,7 +689,7 @@ dsbcfg_setval(dsbcfg_t *node, int vid, dsbcfg_val_t val)
 		free(node->vars[vid].val.strings);
 		node->vars[vid].val.strings = NULL;
 		for (pp = val.strings; pp != NULL && *pp != NULL; pp++) {
-			if (add_string(&node->vars[vid].val.strings, *pp)
+			if (add_string(ctx, &node->vars[vid].val.strings, *pp)
 			    == NULL)
 				return (-1);
 		}
@@ -526,6 +701,121 @@ dsbcfg_setval(dsbcfg_t *node, int vid, dsbcfg_val_t val)
 	return (0);
 }
 
+/*
+ * Returns true if the given variable has the value 'val'.
+ */
+static bool
+var_equals(const dsbcfg_var_t *var, dsbcfg_val_t val)
+{
+	char **p, **q;
+
+	switch (var->type) {
+	case DSBCFG_VAR_STRING:
+		if (var->val.string == NULL || val.string == NULL)
+			return (var->val.string == val.string);
+		return (strcmp(var->val.string, val.string) == 0);
+	case DSBCFG_VAR_STRINGS:
+		p = var->val.strings; q = val.strings;
+		for (; p != NULL && q != NULL && *p != NULL && *q != NULL;
+		    p++, q++) {
+			if (strcmp(*p, *q) != 0)
+				return (false);
+		}
+		return ((p == NULL || *p == NULL) && (q == NULL || *q == NULL));
+	case DSBCFG_VAR_INTEGER:
+		return (var->val.integer == val.integer);
+	case DSBCFG_VAR_BOOLEAN:
+		return (var->val.boolean == val.boolean);
+	}
+	return (false);
+}
+
+/*
+ * Returns true if the given variable has the same value in both nodes,
+ * and was either set in both or in neither of them.
+ */
+bool
+dsbcfg_varequal(const dsbcfg_t *a, const dsbcfg_t *b, int vid)
+{
+	if (a->vars[vid].set != b->vars[vid].set)
+		return (false);
+	return (var_equals(&a->vars[vid], b->vars[vid].val));
+}
+
+bool
+dsbcfg_isdirty(const dsbcfg_t *cfg)
+{
+	for (; cfg != NULL; cfg = cfg->next) {
+		if (cfg->dirty)
+			return (true);
+	}
+	return (false);
+}
+
+/*
+ * Writes the config file only if any section was changed since the
+ * last read or write.
+ */
+int
+dsbcfg_flush(const char *subdir, const char *file, dsbcfg_t *cfg)
+{
+	return (dsbcfg_flush_r(&defctx, subdir, file, cfg));
+}
+
+int
+dsbcfg_flush_r(dsbcfg_parser_t *ctx, const char *subdir, const char *file,
+	       dsbcfg_t *cfg)
+{
+	int	 i;
+	dsbcfg_t *cp;
+
+	if (!dsbcfg_isdirty(cfg))
+		return (0);
+	if (dsbcfg_write_r(ctx, subdir, file, cfg) == -1)
+		return (-1);
+	for (cp = cfg; cp != NULL; cp = cp->next) {
+		cp->dirty = false;
+		for (i = 0; i < cp->nvars; i++)
+			cp->vars[i].dirty = false;
+	}
+	return (0);
+}
+
+/*
+ * Applies the changes made to 'src' since it was read or written the last
+ * time to 'dst', which is usually a fresh copy of the same file. Variables
+ * not changed in 'src' keep their value from 'dst', and sections added to
+ * 'src' are added to 'dst'. Changed variables and added sections are
+ * marked as dirty in 'dst'.
+ */
+int
+dsbcfg_merge(dsbcfg_t *dst, const dsbcfg_t *src, dsbcfg_vardef_t *vardefs,
+	     int nvardefs)
+{
+	int		i;
+	dsbcfg_t	*np;
+	const dsbcfg_t	*sp;
+
+	for (sp = src; sp != NULL; sp = sp->next) {
+		if (!sp->dirty)
+			continue;
+		if ((np = dsbcfg_getnode(dst, sp->label)) == NULL) {
+			if (sp->label == NULL)
+				continue;
+			np = dsbcfg_addnode(dst, sp->label, vardefs, nvardefs);
+			if (np == NULL)
+				return (-1);
+		}
+		for (i = 0; i < sp->nvars && i < np->nvars; i++) {
+			if (!sp->vars[i].dirty)
+				continue;
+			if (dsbcfg_setval(np, i, sp->vars[i].val) == -1)
+				return (-1);
+		}
+	}
+	return (0);
+}
+
 /*
  * Extends the string vector at *strv by the given string and terminates
  * the vector with a NULL-pointer.
@@ -533,10 +823,10 @@ dsbcfg_setval(dsbcfg_t *node, int vid, dsbcfg_val_t val)
  * Returns the new string vector.
  */
 static char **
-add_string(char ***strv, const char *str)
-{       
-        static int    n;
-        static char **p;
+add_string(dsbcfg_parser_t *ctx, char ***strv, const char *str)
+{
+	int  n;
+	char **p;
 
 	if (*strv == NULL)
 		n = 0;
@@ -554,14 +844,14 @@ add_string(char ***strv, const char *str)
 
 	return (p);
 error:
-	seterr(DSBCFG_ERR_SYS_ERROR, "add_string()");
+	seterr(ctx, DSBCFG_ERR_SYS_ERROR, "add_string()");
 	for (p = *strv; p != NULL && *p != NULL; p++)
 		free(*p);
 	return (NULL);
 }
 
 static char *
-strdupstrcat(char **buf, char *str)
+strdupstrcat(dsbcfg_parser_t *ctx, char **buf, char *str)
 {
 	char   *p;
 	size_t len;
@@ -570,32 +860,13 @@ strdupstrcat(char **buf, char *str)
 	if (*buf != NULL)
 		len += strlen(*buf);
 	if ((p = realloc(*buf, len)) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "realloc()");
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "realloc()");
 		return (NULL);
 	}
 	*buf = p;
 	return (strcat(p, str));
 }
 
-static char *
-escape_str(const char *str)
-{
-	char *p, *esc;
-
-	if ((esc = malloc(2 * strlen(str) + 1)) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "malloc()");
-		return (NULL);
-	}
-	for (p = esc; *str != '\0'; str++) {
-		if (*str == '"' || *str == '\\')
-			*p++ = '\\';
-		*p++ = *str;
-	}
-	*p = '\0';
-
-	return (esc);
-}
-
 /*
  * Extracts the first (str != NULL) or the next (str == NULL) token from a
  * comma  separated  list  of  (quoted) strings, while respecting the
@@ -605,42 +876,43 @@ escape_str(const char *str)
  * or a syntax error was found.
  */
 static char *
-cutok(char *str, bool *error)
+cutok(dsbcfg_parser_t *ctx, char *str, bool *error)
 {
-	static int  esc, quote;
-	static char *p, *q, *start = NULL;
+	int		esc, quote;
+	char		*p, *q;
+	struct parser_s *ps = &ctx->parser;
 
 	if (str != NULL) {
-		free(parser.pbuf);
-		parser.needline = false;
-		parser.pbuf = start = strdup(str);
-		if (parser.pbuf == NULL) {
+		free(ps->pbuf);
+		ps->needline = false;
+		ps->pbuf = ps->tokstart = strdup(str);
+		if (ps->pbuf == NULL) {
 			*error = true;
-			seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
 			return (NULL);
 		}		
-	} else if (parser.needline) {
-		parser.needline = false;
-		if ((p = readln()) == NULL) {
-			if (_error.errcode > 0) {
+	} else if (ps->needline) {
+		ps->needline = false;
+		if ((p = readln(ctx)) == NULL) {
+			if (ctx->error.errcode > 0) {
 				*error = true; return (NULL);
 			}
 			/* Ignore '\' at the end of the last line. */
-			return (cutok(NULL, error));
+			return (cutok(ctx, NULL, error));
 		}
-		(void)strtok(p, "\n");
+		p[strcspn(p, "\n")] = '\0';
 		if (*p == '\0')
 			/* Empty line */
-			return (cutok(NULL, error));
+			return (cutok(ctx, NULL, error));
 		/* Ignore trailing spaces and tabs. */
 		for (q = p; isspace(*q); q++)
 			;
-		if ((start = strdupstrcat(&parser.pbuf, q)) == NULL) {
+		if ((ps->tokstart = strdupstrcat(ctx, &ps->pbuf, q)) == NULL) {
 			*error = true; return (NULL);
 		}
 	}
 	/* Check if line ends with a '\' */
-	for (esc = 0, p = parser.pbuf; *p != '\0'; p++) {
+	for (esc = 0, p = ps->pbuf; *p != '\0'; p++) {
 		if (*p == '\\')
 			esc ^= 1;
 		else if (esc)
@@ -649,38 +921,40 @@ cutok(char *str, bool *error)
 	if (esc) {
 		/* Current line ends with a '\'. Concatinate next line. */
 		p[-1] = '\0';
-		parser.needline = true;
-		return (cutok(NULL, error));
+		ps->needline = true;
+		return (cutok(ctx, NULL, error));
 	} else
-		parser.needline = false;
-	while (*start != '\0' && isspace(*start))
-		start++;
-	if (*start == '"') {
-		start++; quote = 1;
+		ps->needline = false;
+	while (*ps->tokstart != '\0' && isspace(*ps->tokstart))
+		ps->tokstart++;
+	if (*ps->tokstart == '"') {
+		ps->tokstart++; quote = 1;
 	} else
 		quote = 0;
-	if (*start == '\0') {
+	if (*ps->tokstart == '\0') {
 		if (quote == 1) {
-			seterr(DSBCFG_ERR_UNTERMINATED, NULL);
+			seterr(ctx, DSBCFG_ERR_UNTERMINATED, NULL);
 			*error = true;
 		} else
 			*error = false;
 		return (NULL);
 	}
 	*error = true;
-	for (p = str = start; *str != '\0'; str++) {
+	for (p = str = ps->tokstart; *str != '\0'; str++) {
 		if (*str == '\\') {
 			*p++ = *++str;
 		} else if (*str == '"') {
 			quote ^= 1;
 		} else if (!quote) {
 			if (*str == '#') {
-				*p = '\0'; p = start; start = str;
+				*p = '\0'; p = ps->tokstart;
+				ps->tokstart = str;
 				return (p);
 			} if (isspace(*str)) {
 				continue;	
 			} else if (*str == ',') {
-				*p++ = '\0'; p = start; start = str + 1;
+				*p++ = '\0'; p = ps->tokstart;
+				ps->tokstart = str + 1;
 				*error = false;
 				return (p);
 			} else
@@ -688,9 +962,9 @@ cutok(char *str, bool *error)
 		} else
 			*p++ = *str;
 	}
-	*p = '\0'; p = start; start = str;
+	*p = '\0'; p = ps->tokstart; ps->tokstart = str;
 	if (quote == 1) {
-		seterr(DSBCFG_ERR_UNTERMINATED, NULL);
+		seterr(ctx, DSBCFG_ERR_UNTERMINATED, NULL);
 		return (NULL);
 	}
 	*error = false;
@@ -719,63 +993,74 @@ is_label(const char *str)
         return (false);
 }
 
+/*
+ * Returns the next line of the config file. The whole file is read into
+ * memory on the first call. Lines are found with memchr(), and terminated
+ * in place, so no data is ever moved. The returned lines remain valid
+ * until the file is closed.
+ */
 static char *
-readln()
+readln(dsbcfg_parser_t *ctx)
 {
-	int		 i, n;
-	char		*p;
-	struct parser_s *ps = &parser;
+	char		*p, *nl;
+	ssize_t		 n;
+	struct stat	 sb;
+	struct parser_s *ps = &ctx->parser;
 
+	if (ps->fp == NULL)
+		return (NULL);
 	if (ps->lnbuf == NULL) {
-		if ((ps->lnbuf = malloc(_POSIX2_LINE_MAX)) == NULL)
+		if (fstat(fileno(ps->fp), &sb) == -1) {
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "fstat()");
 			return (NULL);
-		ps->bufsz = _POSIX2_LINE_MAX;
-	}
-	n = 0;
-	do {
-		ps->rd += n;
-		if (ps->slen > 0) {
-			for (i = 0; i < ps->rd - ps->slen; i++)
-				ps->lnbuf[i] = ps->lnbuf[i + ps->slen];
 		}
-		ps->rd  -= ps->slen;
-		ps->slen = 0;
-		for (i = 0; i < ps->rd && ps->lnbuf[i] != '\n'; i++)
-			;
-		if (i < ps->rd && ps->lnbuf[i] == '\n') {
-			ps->slen = i + 1;
-			if (ps->slen >= ps->bufsz - 1)
-				ps->slen = ps->rd = 0;
-			ps->lnbuf[i] = '\0'; ps->lineno++;
-			return (ps->lnbuf);
+		/*
+		 * Leave room for one byte more than the file size, so that
+		 * only a file that grew since fstat() fills the buffer.
+		 */
+		ps->bufsz = sb.st_size > 0 ? sb.st_size + 2 : _POSIX2_LINE_MAX;
+		if ((ps->lnbuf = malloc(ps->bufsz)) == NULL) {
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "malloc()");
+			return (NULL);
 		}
-		if (ps->rd >= ps->bufsz - 1) {
-			p = realloc(ps->lnbuf, ps->bufsz + _POSIX2_LINE_MAX);
-			if (p == NULL) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "realloc()");
+		ps->len = ps->pos = 0;
+		while ((n = read(fileno(ps->fp), ps->lnbuf + ps->len,
+		    ps->bufsz - ps->len - 1)) > 0) {
+			ps->len += n;
+			if (ps->len < ps->bufsz - 1)
+				continue;
+			/* The file grew since we called fstat(). */
+			if ((p = realloc(ps->lnbuf, ps->bufsz * 2)) == NULL) {
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "realloc()");
 				return (NULL);
 			}
 			ps->lnbuf  = p;
-			ps->bufsz += _POSIX2_LINE_MAX;
+			ps->bufsz *= 2;
 		}
-	} while ((n = fread(ps->lnbuf + ps->rd, 1,
-	    ps->bufsz - ps->rd - 1, ps->fp)) > 0);
-	if (ferror(ps->fp)) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "fread()");
-		return (NULL);
-	}
-	if (ps->rd > 0) {
-		ps->lnbuf[ps->rd] = '\0';
-		ps->slen = ps->rd = 0; ps->lineno++;
-		return (ps->lnbuf);
+		if (n == -1) {
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "read()");
+			return (NULL);
+		}
+		ps->lnbuf[ps->len] = '\0';
+		stamp_read(ctx, fileno(ps->fp), ps->file, &sb, ps->len,
+		    hash_buf(ps->lnbuf, ps->len));
 	}
-	ps->slen = ps->rd = 0;
+	if (ps->pos >= ps->len)
+		return (NULL);
+	p = ps->lnbuf + ps->pos;
+	if ((nl = memchr(p, '\n', ps->len - ps->pos)) != NULL) {
+		*nl = '\0';
+		ps->pos = nl - ps->lnbuf + 1;
+	} else
+		ps->pos = ps->len;
+	ps->lineno++;
 
-	return (NULL);
+	return (p);
 }
 
 static int
-var_set_defaults(dsbcfg_var_t *vars, dsbcfg_vardef_t *vardefs, int nvardefs)
+var_set_defaults(dsbcfg_parser_t *ctx, dsbcfg_var_t *vars,
+		 dsbcfg_vardef_t *vardefs, int nvardefs)
 {
 	int    i, id;
 	char **pp;
@@ -789,13 +1074,13 @@ var_set_defaults(dsbcfg_var_t *vars, dsbcfg_vardef_t *vardefs, int nvardefs)
 		    vardefs[i].dflt.string != NULL) {
 			vars[id].val.string = strdup(vardefs[i].dflt.string);
 			if (vars[id].val.string == NULL) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
+				seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
 				return (-1);
 			}
 		} else if (vardefs[i].type == DSBCFG_VAR_STRINGS) {
 			for (pp = vardefs[i].dflt.strings;
 			     pp != NULL && *pp != NULL; pp++) {
-				if (add_string(&vars[id].val.strings, *pp)
+				if (add_string(ctx, &vars[id].val.strings, *pp)
 				    == NULL)
 					return (-1);
 			}
@@ -806,8 +1091,8 @@ var_set_defaults(dsbcfg_var_t *vars, dsbcfg_vardef_t *vardefs, int nvardefs)
 }
 
 static int
-parse_line(char *str, dsbcfg_vardef_t *vardefs, int nvardefs,
-	   dsbcfg_var_t *_vars)
+parse_line(dsbcfg_parser_t *ctx, char *str, dsbcfg_vardef_t *vardefs,
+	   int nvardefs, dsbcfg_var_t *_vars)
 {
 	int   i, id;
 	bool  error;
@@ -820,200 +1105,762 @@ parse_line(char *str, dsbcfg_vardef_t *vardefs, int nvardefs,
 	    *val != '=' && *val != '\0'; val++)
 		*val = '\0';
 	if (*val != '=') {
-		seterr(DSBCFG_ERR_MISSING_SEP, NULL); return (-1);
+		seterr(ctx, DSBCFG_ERR_MISSING_SEP, NULL); return (-1);
 	}
 	*val++ = '\0'; val += strspn(val, " \t\n");
-	for (i = 0; i < nvardefs; i++) {
-		if (strcmp(var, vardefs[i].name) != 0)
-			continue;
-		id = vardefs[i].id;
-		_vars[id].name = vardefs[i].name;
-		_vars[id].type = vardefs[i].type;
+	if ((i = find_vardef(ctx, vardefs, nvardefs, var)) == -1) {
+		seterr(ctx, DSBCFG_ERR_UNKNOWN_VAR, NULL);
+		return (-1);
+	}
+	id = vardefs[i].id;
+	_vars[id].name = vardefs[i].name;
+	_vars[id].type = vardefs[i].type;
+	_vars[id].set  = true;
 
-		switch (vardefs[i].type) {
-		case DSBCFG_VAR_STRINGS:
-			for (pp = _vars[id].val.strings;
-			     pp != NULL && *pp != NULL; pp++)
-				free(*pp), *pp = NULL;
-			free(_vars[id].val.strings);
-			_vars[id].val.strings = NULL;
-			for (p = val; (p = cutok(p, &error)) != NULL;
-			     p = NULL) {
-				if (add_string(&_vars[id].val.strings, p)
-				    == NULL)
-					return (-1);
-			}
-			if (error)
+	switch (vardefs[i].type) {
+	case DSBCFG_VAR_STRINGS:
+		for (pp = _vars[id].val.strings;
+		     pp != NULL && *pp != NULL; pp++)
+			free(*pp), *pp = NULL;
+		free(_vars[id].val.strings);
+		_vars[id].val.strings = NULL;
+		for (p = val; (p = cutok(ctx, p, &error)) != NULL;
+		     p = NULL) {
+			if (add_string(ctx, &_vars[id].val.strings, p)
+			    == NULL)
 				return (-1);
+		}
+		if (error)
+			return (-1);
+		break;
+	case DSBCFG_VAR_STRING:
+		if ((p = cutok(ctx, val, &error)) == NULL)
+			return (-1);
+		free(_vars[id].val.string);
+		if ((_vars[id].val.string = strdup(p)) == NULL) {
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "strdup()");
+			return (-1);
+		}
+		break;
+	case DSBCFG_VAR_BOOLEAN:
+		if ((p = cutok(ctx, val, &error)) == NULL)
+			return (-1);
+		if (strcasecmp(p, "false") == 0 ||
+		    strcasecmp(p, "no") == 0	||
+		    (isdigit(p[0]) && strtol(p, NULL, 10) == 0))
+			_vars[id].val.boolean = false;
+		else
+			_vars[id].val.boolean = true;
+		break;
+	case DSBCFG_VAR_INTEGER:
+		if ((p = cutok(ctx, val, &error)) == NULL)
+			return (-1);
+		_vars[id].val.integer = strtol(p, NULL, 10);
+		break;
+	}
+	return (0);
+}
+
+/*
+ * Returns the index of the variable with the given name in 'vardefs', or
+ * -1 if there is no such variable.
+ */
+static int
+find_vardef(dsbcfg_parser_t *ctx, const dsbcfg_vardef_t *vardefs,
+	    int nvardefs, const char *name)
+{
+	int		  i;
+	size_t		  j, mask;
+	struct varindex_s *vi;
+
+	for (vi = ctx->varindexes; vi != NULL; vi = vi->next) {
+		if (vi->vardefs == vardefs && vi->nvardefs == nvardefs)
 			break;
-		case DSBCFG_VAR_STRING:
-			if ((p = cutok(val, &error)) == NULL)
-				return (-1);
-			free(_vars[id].val.string);
-			if ((_vars[id].val.string = strdup(p)) == NULL) {
-				seterr(DSBCFG_ERR_SYS_ERROR, "strdup()");
-				return (-1);
+	}
+	if (vi == NULL && (vi = calloc(1, sizeof(*vi))) != NULL) {
+		for (vi->size = 8; vi->size < (size_t)nvardefs * 2;)
+			vi->size *= 2;
+		if ((vi->slots = calloc(vi->size, sizeof(int))) == NULL) {
+			free(vi); vi = NULL;
+		}
+	}
+	if (vi == NULL) {
+		/* Out of memory. Fall back to a linear search. */
+		for (i = 0; i < nvardefs; i++) {
+			if (strcmp(name, vardefs[i].name) == 0)
+				return (i);
+		}
+		return (-1);
+	}
+	mask = vi->size - 1;
+	if (vi->vardefs == NULL) {
+		/* New index. The first definition of a name wins. */
+		for (i = 0; i < nvardefs; i++) {
+			for (j = hash_str(vardefs[i].name) & mask;
+			    vi->slots[j] != 0; j = (j + 1) & mask) {
+				if (strcmp(vardefs[vi->slots[j] - 1].name,
+				    vardefs[i].name) == 0)
+					break;
 			}
-			break;
-		case DSBCFG_VAR_BOOLEAN:
-			if ((p = cutok(val, &error)) == NULL)
-				return (-1);
-			if (strcasecmp(p, "false") == 0 ||
-			    strcasecmp(p, "no") == 0	||
-			    (isdigit(p[0]) && strtol(p, NULL, 10) == 0))
-				_vars[id].val.boolean = false;
-			else
-				_vars[id].val.boolean = true;
-			break;
-		case DSBCFG_VAR_INTEGER:
-			if ((p = cutok(val, &error)) == NULL)
-				return (-1);
-			_vars[id].val.integer = strtol(p, NULL, 10);
-			break;
+			if (vi->slots[j] == 0)
+				vi->slots[j] = i + 1;
 		}
-		return (0);
+		vi->vardefs  = vardefs;
+		vi->nvardefs = nvardefs;
+		vi->next     = ctx->varindexes;
+		ctx->varindexes = vi;
 	}
-	seterr(DSBCFG_ERR_UNKNOWN_VAR, NULL);
+	for (j = hash_str(name) & mask; vi->slots[j] != 0; j = (j + 1) & mask) {
+		if (strcmp(vardefs[vi->slots[j] - 1].name, name) == 0)
+			return (vi->slots[j] - 1);
+	}
+	return (-1);
+}
+
+/*
+ * FNV-1a hash of the given string.
+ */
+static uint32_t
+hash_str(const char *str)
+{
+	uint32_t h;
+
+	for (h = 2166136261U; *str != '\0'; str++) {
+		h ^= (u_char)*str;
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ * Returns the first node of the list the given node belongs to.
+ */
+static dsbcfg_t *
+rootnode(dsbcfg_t *node)
+{
+	while (node->prev != NULL)
+		node = node->prev;
+	return (node);
+}
+
+/*
+ * Makes the given node the first node of a new config, and creates its
+ * section index.
+ */
+static int
+init_root(dsbcfg_parser_t *ctx, dsbcfg_t *node)
+{
+	if ((node->index = calloc(1, sizeof(struct dsbcfg_index_s))) == NULL)
+		goto error;
+	node->index->size = INDEX_MINSIZE;
+	node->index->slots = calloc(INDEX_MINSIZE, sizeof(dsbcfg_t *));
+	if (node->index->slots == NULL)
+		goto error;
+	node->prev = node->next = NULL;
+	node->index->tail = node;
+	return (index_add(ctx, node->index, node));
+error:
+	seterr(ctx, DSBCFG_ERR_SYS_ERROR, "calloc()");
+	index_free(node->index);
+	node->index = NULL;
 	return (-1);
 }
 
+/*
+ * Appends the given node to the list of sections starting at 'root'.
+ */
+static int
+append_node(dsbcfg_parser_t *ctx, dsbcfg_t *root, dsbcfg_t *node)
+{
+	if (index_add(ctx, root->index, node) == -1)
+		return (-1);
+	node->next = NULL;
+	node->prev = root->index->tail;
+	root->index->tail->next = node;
+	root->index->tail = node;
+
+	return (0);
+}
+
+/*
+ * Removes the given node from the list at *cfg, and frees it.
+ */
+static void
+unlink_node(dsbcfg_t **cfg, dsbcfg_t *node)
+{
+	struct dsbcfg_index_s *idx = (*cfg)->index;
+
+	index_del(idx, node);
+	if (node->prev != NULL) {
+		node->prev->next  = node->next;
+		node->prev->dirty = true;
+	}
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	if (idx->tail == node)
+		idx->tail = node->prev;
+	if (node == *cfg) {
+		/* Move the index to the new first node. */
+		if ((*cfg = node->next) != NULL) {
+			(*cfg)->index = idx;
+			(*cfg)->dirty = true;
+		} else
+			index_free(idx);
+		node->index = NULL;
+	}
+	free_node(node);
+}
+
+/*
+ * Returns the slot holding the section with the given label, or the
+ * slot where it would be inserted.
+ */
+static dsbcfg_t **
+index_slot(const struct dsbcfg_index_s *idx, const char *label)
+{
+	size_t	 i, mask;
+	dsbcfg_t **deleted;
+
+	mask = idx->size - 1;
+	for (deleted = NULL, i = hash_str(label) & mask;; i = (i + 1) & mask) {
+		if (idx->slots[i] == NULL)
+			return (deleted != NULL ? deleted : &idx->slots[i]);
+		if (idx->slots[i] == SLOT_DELETED) {
+			if (deleted == NULL)
+				deleted = &idx->slots[i];
+		} else if (strcmp(idx->slots[i]->label, label) == 0)
+			return (&idx->slots[i]);
+	}
+}
+
+static dsbcfg_t *
+index_lookup(const struct dsbcfg_index_s *idx, const char *label)
+{
+	dsbcfg_t **slot;
+
+	if (label == NULL)
+		return (idx->global);
+	slot = index_slot(idx, label);
+	if (*slot == NULL || *slot == SLOT_DELETED)
+		return (NULL);
+	return (*slot);
+}
+
+static int
+index_add(dsbcfg_parser_t *ctx, struct dsbcfg_index_s *idx, dsbcfg_t *node)
+{
+	dsbcfg_t **slot;
+
+	if (node->label == NULL) {
+		idx->global = node;
+		return (0);
+	}
+	/* Keep the load factor, including deleted slots, below 1/2. */
+	if ((idx->used + 1) * 2 > idx->size && index_grow(ctx, idx) == -1)
+		return (-1);
+	slot = index_slot(idx, node->label);
+	if (*slot == NULL)
+		idx->used++;
+	*slot = node;
+	idx->count++;
+
+	return (0);
+}
+
+static void
+index_del(struct dsbcfg_index_s *idx, dsbcfg_t *node)
+{
+	dsbcfg_t **slot;
+
+	if (node->label == NULL) {
+		if (idx->global == node)
+			idx->global = NULL;
+		return;
+	}
+	slot = index_slot(idx, node->label);
+	if (*slot == node) {
+		*slot = SLOT_DELETED;
+		idx->count--;
+	}
+}
+
+/*
+ * Rehashes the index into a table of at least four times the number of
+ * sections. This also drops the deleted slots.
+ */
+static int
+index_grow(dsbcfg_parser_t *ctx, struct dsbcfg_index_s *idx)
+{
+	size_t	 i, j, size, mask;
+	dsbcfg_t **slots;
+
+	for (size = INDEX_MINSIZE; size < (idx->count + 1) * 4;)
+		size *= 2;
+	if ((slots = calloc(size, sizeof(dsbcfg_t *))) == NULL) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "calloc()");
+		return (-1);
+	}
+	mask = size - 1;
+	for (i = 0; i < idx->size; i++) {
+		if (idx->slots[i] == NULL || idx->slots[i] == SLOT_DELETED)
+			continue;
+		for (j = hash_str(idx->slots[i]->label) & mask;
+		    slots[j] != NULL; j = (j + 1) & mask)
+			;
+		slots[j] = idx->slots[i];
+	}
+	free(idx->slots);
+	idx->slots = slots;
+	idx->size  = size;
+	idx->used  = idx->count;
+
+	return (0);
+}
+
+static void
+index_free(struct dsbcfg_index_s *idx)
+{
+	if (idx == NULL)
+		return;
+	free(idx->slots);
+	free(idx);
+}
+
 static dsbcfg_t *
-new_config_node(int nvars)
+new_config_node(dsbcfg_parser_t *ctx, int nvars)
 {
 	dsbcfg_t *cp;
 
 	if ((cp = calloc(1, sizeof(dsbcfg_t))) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "calloc()");
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "calloc()");
 		return (NULL);
 	}
 	cp->nvars = nvars;
 	cp->vars  = calloc(nvars, sizeof(dsbcfg_var_t));
 	if (nvars > 0 && cp->vars == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "calloc()");
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "calloc()");
 		return (NULL);
 	}
 	return (cp);
 }
 
 static int
-open_cfg_file(const char *subdir, const char *file)
+open_cfg_file(dsbcfg_parser_t *ctx, const char *subdir, const char *file)
 {
-	parser.fp     = NULL;
-	parser.pbuf   = parser.lnbuf = NULL;
-	parser.lineno = parser.bufsz = parser.rd = parser.slen = 0;
+	ctx->parser.fp     = NULL;
+	ctx->parser.pbuf   = ctx->parser.lnbuf = NULL;
+	ctx->parser.lineno = 0;
+	ctx->parser.bufsz  = ctx->parser.len = ctx->parser.pos = 0;
 
-	_error.errcode = _error._errno = -1;
+	ctx->error.errcode = ctx->error._errno = -1;
 
-	if (cfgpath(subdir, file) == NULL)
+	if (cfgpath(ctx, subdir, file) == NULL)
 		return (-1);
-	if ((parser.fp = fopen(parser.file, "r+")) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, parser.file);
+	if ((ctx->parser.fp = fopen(ctx->parser.file, "r+")) == NULL) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, ctx->parser.file);
 		return (-1);
 	}
 	return (0);
 }
 
 static void
-close_cfg_file()
+close_cfg_file(dsbcfg_parser_t *ctx)
 {
-	if (parser.fp != NULL)
-		(void)fclose(parser.fp);
-	free(parser.pbuf); free(parser.lnbuf);
-	parser.fp     = NULL;
-	parser.pbuf   = parser.lnbuf = NULL;
-	parser.lineno = parser.bufsz = parser.rd = parser.slen = 0;
+	if (ctx->parser.fp != NULL)
+		(void)fclose(ctx->parser.fp);
+	free(ctx->parser.pbuf); free(ctx->parser.lnbuf);
+	ctx->parser.fp     = NULL;
+	ctx->parser.pbuf   = ctx->parser.lnbuf = ctx->parser.tokstart = NULL;
+	ctx->parser.lineno = 0;
+	ctx->parser.bufsz  = ctx->parser.len = ctx->parser.pos = 0;
 }
 
+/*
+ * Serializes the config, and writes it to a temporary file which is then
+ * renamed to the config file. Nothing is written if the file already has
+ * the same content.
+ */
 int
 dsbcfg_write(const char *subdir, const char *file, const dsbcfg_t *cfg)
 {
-	int   i, fd;
-	FILE *fp, *tmpfp;
-	char *path, tmpl[sizeof(parser.file) + 8];
+	return (dsbcfg_write_r(&defctx, subdir, file, cfg));
+}
 
-	fd = -1; fp = tmpfp = NULL; path = NULL;
-	if (open_cfg_file(subdir, file) == -1) {
-		if (errno != ENOENT)
-			goto error;
-		if ((path = dsbcfg_mkdir(subdir)) == NULL)
-			return (-1);
-		free(path);
-		if ((path = cfgpath(subdir, file)) == NULL)
+int
+dsbcfg_write_r(dsbcfg_parser_t *ctx, const char *subdir, const char *file,
+	       const dsbcfg_t *cfg)
+{
+	int ret;
+
+	DTRACE_PROBE1(dsbcfg, write__start, file);
+	ret = write_cfg(ctx, subdir, file, cfg);
+	DTRACE_PROBE2(dsbcfg, write__done, file, ret);
+
+	return (ret);
+}
+
+static int
+write_cfg(dsbcfg_parser_t *ctx, const char *subdir, const char *file,
+	  const dsbcfg_t *cfg)
+{
+	int		fd;
+	char		*p, path[CFG_PATH_MAX];
+	char		tmpl[CFG_PATH_MAX + 8];
+	size_t		len, size;
+	ssize_t		n;
+	uint64_t	hash, oldhash;
+	struct stat	sb;
+	struct outbuf_s ob;
+
+	fd = -1; tmpl[0] = '\0'; (void)memset(&ob, 0, sizeof(ob));
+	ob.ctx = ctx;
+	if ((p = cfgpath(ctx, subdir, file)) == NULL)
+		return (-1);
+	(void)strcpy(path, p);
+	if (serialize(cfg, &ob) == -1)
+		goto error;
+	hash = hash_buf(ob.buf, ob.len);
+	if (file_hash(ctx, path, &size, &oldhash) == 0 && size == ob.len &&
+	    oldhash == hash) {
+		free(ob.buf);
+		return (0);
+	}
+	if (*file != '/') {
+		if ((p = dsbcfg_mkdir_r(ctx, subdir)) == NULL)
 			goto error;
-		if ((fp = fopen(path, "w+")) == NULL) {
-			seterr(DSBCFG_ERR_SYS_ERROR,
-			    "Couldn't create config file.");
+		free(p);
+	}
+	(void)snprintf(tmpl, sizeof(tmpl), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmpl)) == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "mkstemp()");
+		tmpl[0] = '\0';
+		goto error;
+	}
+	for (len = 0; len < ob.len; len += n) {
+		if ((n = write(fd, ob.buf + len, ob.len - len)) == -1) {
+			if (errno == EINTR) {
+				n = 0; continue;
+			}
+			seterr(ctx, DSBCFG_ERR_SYS_ERROR, "write()");
 			goto error;
 		}
-		(void)fclose(fp);
-		if (open_cfg_file(subdir, file) == -1)
-			goto error;
 	}
-	(void)strcpy(tmpl, parser.file); (void)strcat(tmpl, ".XXXXX");
-
-	if ((fd = mkstemp(tmpl)) == -1) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "mkstemp()");
+	if (ctx->syncmode != DSBCFG_SYNC_NONE && fsync(fd) == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "fsync()");
 		goto error;
 	}
-	if ((tmpfp = fdopen(fd, "r+")) == NULL) {
-		seterr(DSBCFG_ERR_SYS_ERROR, "fdopen()");
+	if (fstat(fd, &sb) == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "fstat()");
 		goto error;
 	}
-	for (; cfg != NULL; cfg = cfg->next) {
-		if (cfg->label != NULL)
-			(void)fprintf(tmpfp, "%s:\n", cfg->label);
-		for (i = 0; i < cfg->nvars; i++)
-			write_var(&cfg->vars[i], tmpfp);
-		(void)fputs("\n", tmpfp);
-	}
-	close_cfg_file(); (void)fclose(tmpfp);
-	rename(tmpl, parser.file);
+	n = close(fd); fd = -1;
+	if (n == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "close()");
+		goto error;
+	}
+	if (rename(tmpl, path) == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "rename()");
+		goto error;
+	}
+	free(ob.buf);
+	set_stamp(ctx, path, &sb, ob.len, hash);
+	if (ctx->syncmode == DSBCFG_SYNC_DIR)
+		return (sync_dir(ctx, path));
 	return (0);
 error:
-	if (tmpfp != NULL)
-		(void)fclose(tmpfp);
-	free(path); close_cfg_file();
+	if (fd != -1)
+		(void)close(fd);
+	if (tmpl[0] != '\0')
+		(void)unlink(tmpl);
+	free(ob.buf);
 	return (-1);
 }
 
+/*
+ * Sets the durability mode of dsbcfg_write().
+ */
+void
+dsbcfg_setsync(int mode)
+{
+	dsbcfg_setsync_r(&defctx, mode);
+}
+
+void
+dsbcfg_setsync_r(dsbcfg_parser_t *ctx, int mode)
+{
+	ctx->syncmode = mode;
+}
+
+dsbcfg_parser_t *
+dsbcfg_parser_new()
+{
+	dsbcfg_parser_t *ctx;
+
+	if ((ctx = calloc(1, sizeof(dsbcfg_parser_t))) == NULL)
+		return (NULL);
+	ctx->syncmode	   = DSBCFG_SYNC_FILE;
+	ctx->error.errcode = -1;
+
+	return (ctx);
+}
+
+void
+dsbcfg_parser_free(dsbcfg_parser_t *ctx)
+{
+	struct varindex_s *vi, *next;
+
+	if (ctx == NULL)
+		return;
+	for (vi = ctx->varindexes; vi != NULL; vi = next) {
+		next = vi->next;
+		free(vi->slots); free(vi);
+	}
+	free(ctx);
+}
+
+static void
+set_stamp(dsbcfg_parser_t *ctx, const char *file, const struct stat *sb,
+	  size_t size, uint64_t hash)
+{
+	(void)strncpy(ctx->stamp.file, file, sizeof(ctx->stamp.file) - 1);
+	ctx->stamp.dev   = sb->st_dev;
+	ctx->stamp.ino   = sb->st_ino;
+	ctx->stamp.mtime = sb->st_mtime;
+	ctx->stamp.size  = size;
+	ctx->stamp.hash  = hash;
+}
+
+/*
+ * Sets the stamp for the 'len' bytes just read from 'fd'. 'before' is the
+ * status of the file before we read it. If the file changed while we read
+ * it, the stamp is cleared, so it is read again next time.
+ */
+static void
+stamp_read(dsbcfg_parser_t *ctx, int fd, const char *file,
+	   const struct stat *before, size_t len, uint64_t hash)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size != (off_t)len ||
+	    sb.st_mtime != before->st_mtime) {
+		ctx->stamp.file[0] = '\0';
+		return;
+	}
+	set_stamp(ctx, file, &sb, len, hash);
+}
+
+/*
+ * Gets the size and the content hash of the given file. The hash is
+ * taken from the stamp if the file didn't change since we read or wrote
+ * it the last time. Returns -1 if the file can't be read.
+ */
 static int
-write_var(dsbcfg_var_t *var, FILE *fp)
+file_hash(dsbcfg_parser_t *ctx, const char *file, size_t *size,
+	  uint64_t *hash)
 {
-	char *p, **s;
+	int	    fd;
+	char	    *buf;
+	size_t	    len;
+	ssize_t	    n;
+	struct stat sb;
 
-	if (var == NULL)
+	if ((fd = open(file, O_RDONLY)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1) {
+		(void)close(fd);
+		return (-1);
+	}
+	if (strcmp(file, ctx->stamp.file) == 0 &&
+	    sb.st_dev == ctx->stamp.dev && sb.st_ino == ctx->stamp.ino &&
+	    sb.st_mtime == ctx->stamp.mtime &&
+	    sb.st_size == (off_t)ctx->stamp.size) {
+		(void)close(fd);
+		*size = ctx->stamp.size; *hash = ctx->stamp.hash;
 		return (0);
+	}
+	if ((buf = malloc(sb.st_size + 1)) == NULL) {
+		(void)close(fd);
+		return (-1);
+	}
+	for (len = 0; len < (size_t)sb.st_size; len += n) {
+		if ((n = read(fd, buf + len, sb.st_size - len)) <= 0)
+			break;
+	}
+	*size = len;
+	*hash = hash_buf(buf, len);
+	stamp_read(ctx, fd, file, &sb, len, *hash);
+	(void)close(fd);
+	free(buf);
+
+	return (0);
+}
+
+/*
+ * FNV-1a hash of the given buffer.
+ */
+static uint64_t
+hash_buf(const char *buf, size_t len)
+{
+	uint64_t h;
+
+	for (h = 14695981039346656037ULL; len > 0; len--, buf++) {
+		h ^= (u_char)*buf;
+		h *= 1099511628211ULL;
+	}
+	return (h);
+}
+
+/*
+ * Writes the given config into one buffer. Labeled sections only contain
+ * the variables that were set, so that the others keep their defaults.
+ */
+static int
+serialize(const dsbcfg_t *cfg, struct outbuf_s *ob)
+{
+	int i;
+
+	for (; cfg != NULL; cfg = cfg->next) {
+		if (cfg->label != NULL && (buf_puts(ob, cfg->label) == -1 ||
+		    buf_puts(ob, ":\n") == -1))
+			return (-1);
+		for (i = 0; i < cfg->nvars; i++) {
+			if (cfg->label != NULL && !cfg->vars[i].set)
+				continue;
+			if (buf_putvar(ob, &cfg->vars[i]) == -1)
+				return (-1);
+		}
+		if (buf_puts(ob, "\n") == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+static int
+buf_putvar(struct outbuf_s *ob, const dsbcfg_var_t *var)
+{
+	char num[16], **s;
 
 	switch (var->type) {
 	case DSBCFG_VAR_STRING:
 		if (var->val.string == NULL)
 			return (0);
-		if ((p = escape_str(var->val.string)) == NULL)
+		/* FALLTHROUGH */
+	case DSBCFG_VAR_STRINGS:
+	case DSBCFG_VAR_INTEGER:
+	case DSBCFG_VAR_BOOLEAN:
+		break;
+	default:
+		return (0);
+	}
+	if (buf_puts(ob, var->name) == -1 || buf_puts(ob, " = ") == -1)
+		return (-1);
+	switch (var->type) {
+	case DSBCFG_VAR_STRING:
+		if (buf_putquoted(ob, var->val.string) == -1)
 			return (-1);
-		(void)fprintf(fp, "%s = \"%s\"\n", var->name, p);
-		free(p);
 		break;
 	case DSBCFG_VAR_STRINGS:
-		(void)fprintf(fp, "%s = ", var->name);
-		for (s = var->val.strings;
-		    s != NULL && *s != NULL; s++) {
-			if ((p = escape_str(*s)) == NULL)
+		for (s = var->val.strings; s != NULL && *s != NULL; s++) {
+			if (buf_putquoted(ob, *s) == -1 ||
+			    (s[1] != NULL && buf_puts(ob, ", ") == -1))
 				return (-1);
-			(void)fprintf(fp, "\"%s\"", p);
-			if (s[1] != NULL)
-				(void)fputs(", ", fp);
-			free(p);
 		}
-		(void)fputc('\n', fp);
 		break;
 	case DSBCFG_VAR_INTEGER:
-		(void)fprintf(fp, "%s = %d\n", var->name, var->val.integer);
+		(void)snprintf(num, sizeof(num), "%d", var->val.integer);
+		if (buf_puts(ob, num) == -1)
+			return (-1);
 		break;
 	case DSBCFG_VAR_BOOLEAN:
-		(void)fprintf(fp, "%s = %s\n", var->name,
-		    var->val.boolean ? "true" : "false");
+		if (buf_puts(ob, var->val.boolean ? "true" : "false") == -1)
+			return (-1);
 		break;
 	}
+	return (buf_puts(ob, "\n"));
+}
+
+/*
+ * Makes room for 'n' more bytes in the buffer.
+ */
+static int
+buf_grow(struct outbuf_s *ob, size_t n)
+{
+	char   *p;
+	size_t size;
+
+	if (ob->len + n <= ob->size)
+		return (0);
+	for (size = ob->size > 0 ? ob->size : 1024; size < ob->len + n;)
+		size *= 2;
+	if ((p = realloc(ob->buf, size)) == NULL) {
+		seterr(ob->ctx, DSBCFG_ERR_SYS_ERROR, "realloc()");
+		return (-1);
+	}
+	ob->buf  = p;
+	ob->size = size;
+
+	return (0);
+}
+
+static int
+buf_puts(struct outbuf_s *ob, const char *str)
+{
+	size_t len;
+
+	len = strlen(str);
+	if (buf_grow(ob, len) == -1)
+		return (-1);
+	(void)memcpy(ob->buf + ob->len, str, len);
+	ob->len += len;
+
+	return (0);
+}
+
+/*
+ * Appends the given string in double quotes, and escapes '"' and '\'.
+ */
+static int
+buf_putquoted(struct outbuf_s *ob, const char *str)
+{
+	char *p;
+
+	if (buf_grow(ob, 2 * strlen(str) + 2) == -1)
+		return (-1);
+	p = ob->buf + ob->len;
+	for (*p++ = '"'; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			*p++ = '\\';
+		*p++ = *str;
+	}
+	*p++ = '"';
+	ob->len = p - ob->buf;
+
 	return (0);
 }
 
+/*
+ * fsync()s the directory containing the given file.
+ */
+static int
+sync_dir(dsbcfg_parser_t *ctx, const char *file)
+{
+	int  fd, ret;
+	char dir[CFG_PATH_MAX], *p;
+
+	(void)strncpy(dir, file, sizeof(dir) - 1);
+	dir[sizeof(dir) - 1] = '\0';
+	if ((p = strrchr(dir, '/')) == NULL)
+		(void)strcpy(dir, ".");
+	else
+		p[p == dir ? 1 : 0] = '\0';
+	if ((fd = open(dir, O_RDONLY)) == -1) {
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "open(%s)", dir);
+		return (-1);
+	}
+	if ((ret = fsync(fd)) == -1)
+		seterr(ctx, DSBCFG_ERR_SYS_ERROR, "fsync(%s)", dir);
+	(void)close(fd);
+
+	return (ret);
+}
+
@@ -40,6 +40,11 @@
 #define DSBCFG_ERR_PATH_EXCEED  0x06
 #define DSBCFG_ERR_SYS_ERROR	0x07
 #define DSBCFG_ERR_DUPLICATED	0x08
+
+/* Durability modes of dsbcfg_write(). */
+#define DSBCFG_SYNC_NONE	0	/* Just rename the new file. */
+#define DSBCFG_SYNC_FILE	1	/* fsync() the file before renaming. */
+#define DSBCFG_SYNC_DIR		2	/* Also fsync() the directory. */
 	
 typedef enum { 
 	DSBCFG_VAR_STRING = 1, DSBCFG_VAR_STRINGS, DSBCFG_VAR_INTEGER,
@@ -61,6 +66,8 @@ typedef struct dsbcfg_var_s {
 	char	  *name;
 	vartype_t type;	
 	dsbcfg_val_t val;
+	bool	  set;	/* Set in the file or by dsbcfg_setval(). */
+	bool	  dirty; /* Changed by dsbcfg_setval() since last read/write. */
 } dsbcfg_var_t;
 
 /*
@@ -73,6 +80,15 @@ typedef struct dsbcfg_vardef_s {
 	dsbcfg_val_t  dflt;	/* Default value. */
 } dsbcfg_vardef_t;
 
+struct dsbcfg_index_s;
+
+/*
+ * Opaque parser context. Functions taking a context can be called from
+ * different threads, as long as each thread uses its own context. The
+ * functions without the _r suffix share a default context.
+ */
+typedef struct dsbcfg_parser_s dsbcfg_parser_t;
+
 /*
  * Struct to hold parsed config file.
  */
@@ -80,20 +96,30 @@ typedef struct dsbcfg_s {
 	int		nvars;	/* # of variables in 'vars' */
 	char		*label;	/* Config file section label. */
 	dsbcfg_var_t	*vars;	/* Array of all variables. */
+	bool		dirty;	/* Section changed since last read/write. */
 	struct dsbcfg_s	*next;	/* Pointer to next section */
+	struct dsbcfg_s	*prev;	/* Pointer to previous section */
+	struct dsbcfg_index_s *index; /* Section label index (first node). */
 } dsbcfg_t;
 
 #define DSBCFG_VAL(V)		(dsbcfg_val_t)V
 #define dsbcfg_getval(CFG, VID)	(CFG->vars[VID].val)
 #define dsbcfg_varname(CFG, VID)(CFG->vars[VID].name)
+#define dsbcfg_isset(CFG, VID)	(CFG->vars[VID].set)
 __BEGIN_DECLS
 extern int	  dsbcfg_write(const char *, const char *, const dsbcfg_t *);
+extern int	  dsbcfg_flush(const char *, const char *, dsbcfg_t *);
 extern int	  dsbcfg_setval(dsbcfg_t *, int, dsbcfg_val_t);
+extern int	  dsbcfg_merge(dsbcfg_t *, const dsbcfg_t *, dsbcfg_vardef_t *,
+		   int);
 extern void	  dsbcfg_free(dsbcfg_t *);
 extern void	  dsbcfg_printerr(void);
+extern void	  dsbcfg_setsync(int);
 extern void	  dsbcfg_delnode(dsbcfg_t **, const char *);
 extern char 	  **dsbcfg_list_to_strings(const char *, bool *);
 extern char	  *dsbcfg_mkdir(const char *);
+extern bool	  dsbcfg_isdirty(const dsbcfg_t *);
+extern bool	  dsbcfg_varequal(const dsbcfg_t *, const dsbcfg_t *, int);
 extern dsbcfg_t	  *dsbcfg_new(const char *, dsbcfg_vardef_t *, int);
 extern dsbcfg_t	  *dsbcfg_read(const char *, const char *, dsbcfg_vardef_t *,
 		   int);
@@ -101,6 +127,19 @@ extern dsbcfg_t	  *dsbcfg_getnode(dsbcfg_t *, const char *);
 extern dsbcfg_t	  *dsbcfg_addnode(dsbcfg_t *, const char *, dsbcfg_vardef_t *,
 		   int);
 extern const char *dsbcfg_strerror(void);
+
+extern int	  dsbcfg_write_r(dsbcfg_parser_t *, const char *, const char *,
+		   const dsbcfg_t *);
+extern int	  dsbcfg_flush_r(dsbcfg_parser_t *, const char *, const char *,
+		   dsbcfg_t *);
+extern void	  dsbcfg_printerr_r(dsbcfg_parser_t *);
+extern void	  dsbcfg_setsync_r(dsbcfg_parser_t *, int);
+extern void	  dsbcfg_parser_free(dsbcfg_parser_t *);
+extern char	  *dsbcfg_mkdir_r(dsbcfg_parser_t *, const char *);
+extern dsbcfg_t	  *dsbcfg_read_r(dsbcfg_parser_t *, const char *, const char *,
+		   dsbcfg_vardef_t *, int);
+extern const char *dsbcfg_strerror_r(dsbcfg_parser_t *);
+extern dsbcfg_parser_t *dsbcfg_parser_new(void);
 __END_DECLS
 #endif	/* !_DSBCFG_H_ */
 
@@ -23,6 +23,7 @@
  */
 
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,27 +39,61 @@
 #include <sys/file.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <paths.h>
 #include <limits.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "dsbcfg/dsbcfg.h"
 #include "gtk-helper/gtk-helper.h"
 
+/*
+ * Static probes for DTrace, perf and bpftrace. See probes.d. They are
+ * compiled out unless built with WITH_USDT.
+ */
+#ifdef WITH_USDT
+# include <sys/sdt.h>
+#else
+# define DTRACE_PROBE(p, n)
+# define DTRACE_PROBE1(p, n, a)
+# define DTRACE_PROBE2(p, n, a, b)
+# define DTRACE_PROBE3(p, n, a, b, c)
+#endif
+
 #define PROGRAM		  "dsbmc"
 #define PATH_CONFIG	  "config"
 #define TITLE		  "DSBMC"
 #define PATH_BOOKMARK	  ".gtk-bookmarks"
 #define PATH_DSBMD_SOCKET "/var/run/dsbmd.socket"
 #define PATH_LOCK	  ".dsbmc.lock"
-#define CMDQSZ		  16
+#define PATH_ICON_CACHE	  "icons.cache"
+#define CMDQSZ		  16	  /* Max. # of queued commands per device. */
 
 #define LABEL_WIDTH	  16
 #define CDR_MAXSPEED	  52
 #define ICON_LOOKUP_FLAGS \
 	(GTK_ICON_LOOKUP_USE_BUILTIN | GTK_ICON_LOOKUP_GENERIC_FALLBACK)
+/*
+ * With GTK >= 3.10, the icons are loaded at the display scale factor, and
+ * shown as cairo surfaces with the device scale set.
+ */
+#if GTK_CHECK_VERSION(3, 10, 0)
+# define load_scaled_icon(theme, name, size, scale) \
+	gtk_icon_theme_load_icon_for_scale(theme, name, size, scale, \
+	    ICON_LOOKUP_FLAGS, NULL)
+# define ICON_SURFACE_TYPE CAIRO_GOBJECT_TYPE_SURFACE
+#else
+# define load_scaled_icon(theme, name, size, scale) \
+	gtk_icon_theme_load_icon(theme, name, size, ICON_LOOKUP_FLAGS, NULL)
+# define ICON_SURFACE_TYPE G_TYPE_POINTER
+#endif
 
 #define MARKUP_BOLD	  "<span font_weight=\"bold\" "			   \
 			  "underline=\"single\">%s</span>"
@@ -80,13 +115,28 @@
 	"<span font=\"monospace\" font_weight=\"bold\">%%d</span> "	   \
 	"will be replaced by the device name.\n"			   \
 	"<span font=\"monospace\" font_weight=\"bold\">%%m</span> "	   \
-	"will be replaced by the mount point."
-
-#define BUSYWIN_MSG _("Please wait ... ")
+	"will be replaced by the mount point.\n"			   \
+	"<span font=\"monospace\" font_weight=\"bold\">%%l</span> "	   \
+	"will be replaced by the volume ID.\n"				   \
+	"<span font=\"monospace\" font_weight=\"bold\">%%f</span> "	   \
+	"will be replaced by the filesystem name.\n"			   \
+	"<span font=\"monospace\" font_weight=\"bold\">%%t</span> "	   \
+	"will be replaced by the disk type.\n"				   \
+	"<span font=\"monospace\" font_weight=\"bold\">%%s</span> "	   \
+	"will be replaced by the drive speed.\n"			   \
+	"<span font=\"monospace\" font_weight=\"bold\">%%%%</span> "	   \
+	"will be replaced by a literal '%%'."
 
 typedef struct icon_s	 icon_t;
 typedef struct drive_s	 drive_t;
 typedef struct ctxmenu_s ctxmenu_t;
+typedef struct cmdtmpl_s cmdtmpl_t;
+typedef struct job_s	 job_t;
+typedef struct command_s command_t;
+struct hist_s;
+struct disktypetbl_s;
+struct iconcache_ent_s;
+struct lostcmd_s;
 
 static int	  process_event(char *);
 static int	  parse_dsbmdevent(char *);
@@ -94,12 +144,72 @@ static int	  create_mddev(const char *);
 static char	  *readln(bool);
 static FILE	  *uconnect(const char *);
 static void	  usage(void);
-static void	  cleanup(int);
-static void	  catch_child(int);
-static void	  sndcmd(void (*re)(icon_t *), icon_t *,
+static void	  prof_mark(int);
+static void	  prof_report(void);
+static void	  start_workers(void);
+static void	  join_workers(void);
+static gpointer	  read_cfg_thread(gpointer);
+static gpointer	  load_icons_thread(gpointer);
+static void	  cleanup(void);
+static gboolean	  quit(gpointer);
+static void	  sigquit(int);
+static void	  child_exited(GPid, gint, gpointer);
+static void	  free_job(job_t *);
+static void	  jobs_window(void);
+static void	  update_jobs_window(void);
+static void	  jobs_window_destroyed(GtkWidget *, gpointer);
+static gboolean	  jobs_timer(gpointer);
+static void	  add_job_row(job_t *);
+static int	  sndcmd(void (*re)(icon_t *), icon_t *,
 			const char *, ...);
-static void	  exec_cmd(const char *, drive_t *);
+static void	  send_cmd(void);
+static void	  finish_cmd(void);
+static void	  abandon_cmd(char, int);
+static void	  cancel_cmds(icon_t *);
+static void	  cb_cancel(GtkWidget *, gpointer);
+static void	  fake_reply(command_t *, char, int);
+static void	  print_queue_stats(void);
+static int	  metric_index(const char *);
+static void	  hist_add(struct hist_s *, gint64);
+static double	  hist_pct(const struct hist_s *, int);
+static void	  add_hist_row(GString *, const char *, const char *,
+			const struct hist_s *);
+static GString	  *metrics_report(void);
+static void	  write_metrics(void);
+static gboolean	  dump_metrics(gpointer);
+static void	  diag_window(void);
+static void	  diag_window_destroyed(GtkWidget *, gpointer);
+static gboolean	  diag_timer(gpointer);
+static void	  update_diag_window(void);
+static void	  record(char, const char *, ...);
+static void	  format_record(u_int, gint64, char *, size_t);
+static void	  print_flightrec(void);
+static gboolean	  dump_flightrec(gpointer);
+static void	  watchdog_changed(const bool *);
+static gboolean	  heartbeat(gpointer);
+static gpointer	  watchdog_thread(gpointer);
+static const char *wd_enter(const char *);
+static void	  wd_leave(const char *);
+static bool	  late_reply(void);
+static bool	  is_reply_to(const char *, const char *);
+static void	  free_lostcmd(struct lostcmd_s *);
+static struct lostcmd_s *find_lostcmd(bool);
+static gboolean	  cmd_timeout(gpointer);
+static void	  exec_cmd(const cmdtmpl_t *, drive_t *);
+static void	  compile_cmdtmpls(const bool *);
+static void	  compile_sect_cmdtmpls(void);
+static void	  free_sectmpls(gpointer);
+static void	  free_cmdtmpl(cmdtmpl_t *);
+static void	  add_tmplseg(cmdtmpl_t *, char, char, char *, size_t);
+static int	  parse_cmdtmpl(cmdtmpl_t *, const char **);
+static char	  *quote_field(char *, const char *, char);
+static char	  **expand_cmdtmpl(const cmdtmpl_t *, const drive_t *);
+static size_t	  quoted_len(const char *, char);
+static cmdtmpl_t  *compile_cmdtmpl(const char *, const char **);
+static const char *field_value(const drive_t *, char, char *, size_t);
 static void	  create_mainwin(void);
+static void	  create_tray_icon(void);
+static void	  show_mainwin(void);
 static void	  hide_win(GtkWidget *);
 static void	  tray_click(GtkStatusIcon *, gpointer);
 static void	  popup_tray_ctxmenu(GtkStatusIcon *, guint, guint, gpointer);
@@ -108,8 +218,33 @@ static void	  update_icons(void);
 static void	  set_mounted(icon_t *, bool);
 static void	  add_bookmark(const char *);
 static void	  del_bookmark(const char *);
+static void	  init_bookmarks(void);
+static void	  read_bookmarks(void);
+static void	  reload_bookmarks(void);
+static void	  apply_bookmark(bool, const char *);
+static void	  change_bookmark(bool, const char *);
+static void	  flush_bookmarks(void);
+static void	  bookmarks_file_changed(GFileMonitor *, GFile *, GFile *,
+			GFileMonitorEvent, gpointer);
+static bool	  bookmarks_changed_on_disk(void);
+static gboolean	  flush_bookmarks_timeout(gpointer);
+static const char *bookmark_path(const char *);
 static void	  create_icon_list(void);
-static void	  load_pixbufs(void);
+static void	  render_icons(void);
+static void	  set_icon_pixbufs(icon_t *);
+static void	  resolve_icons(GtkIconTheme *, int);
+static void	  reload_icons(int);
+static void	  set_store_icon(GtkTreeIter *, GdkPixbuf *);
+static GtkWidget  *new_icon_image(GdkPixbuf *);
+#if GTK_CHECK_VERSION(3, 10, 0)
+static void	  scale_changed(GObject *, GParamSpec *, gpointer);
+#endif
+static int	  iconcache_load(const char *, uint64_t, int);
+static bool	  iconcache_entry_ok(const struct iconcache_ent_s *, size_t);
+static int	  iconcache_save(const char *, uint64_t, int);
+static char	  *iconcache_path(void);
+static uint64_t	  iconcache_stamp(int, const char *, char **, int);
+static uint64_t	  fnv1a(uint64_t, const void *, size_t);
 static void	  del_drive(const char *);
 static void	  del_icon(const char *);
 static void	  cb_mount(GtkWidget *, gpointer);
@@ -120,22 +255,54 @@ static void	  cb_open(GtkWidget *, gpointer);
 static void	  cb_play(GtkWidget *, gpointer);
 static void	  cb_size(GtkWidget *, gpointer);
 static void	  cb_cb(GtkWidget *, gpointer);
+static void	  save_win_geometry(int, int, int, int);
+static void	  bind_cfg(void);
+static void	  flush_cfg(void);
+static void	  init_cfg_monitor(void);
+static void	  stat_cfg(void);
+static int	  reload_cfg(void);
+static void	  cfg_file_changed(GFileMonitor *, GFile *, GFile *,
+			GFileMonitorEvent, gpointer);
+static void	  notify_cfg_changed(const bool *);
+static void	  cmdtmpls_changed(const bool *);
+static void	  autoplay_changed(const bool *);
+static void	  geometry_changed(const bool *);
+static void	  ignore_list_changed(const bool *);
+static void	  sync_changed(const bool *);
+static bool	  cfg_changed_on_disk(void);
+static bool	  devsections_equal(dsbcfg_t *, dsbcfg_t *);
+static bool	  drive_hidden(const drive_t *);
+static bool	  strings_equal(char **, char **);
+static gboolean	  cfg_reload_timeout(gpointer);
+static void	  schedule_cfg_flush(void);
+static gboolean	  cfg_flush_timeout(gpointer);
+static gboolean	  cfg_flush_idle(gpointer);
 static void	  process_mount_reply(icon_t *);
 static void	  process_unmount_reply(icon_t *);
 static void	  process_open_reply(icon_t *);
 static void	  process_size_reply(icon_t *);
 static void	  process_speed_reply(icon_t *);
 static void	  process_eject_reply(icon_t *);
+static void	  force_unmount_answer(int, gpointer);
+static void	  force_eject_answer(int, gpointer);
+static void	  send_forced_cmd(int, char *, void (*)(icon_t *), const char *);
 static void	  call_reply_function(void);
-static void	  busywin(const char *msg, bool show);
+static void	  set_busy(icon_t *, bool);
+static void	  update_icon(icon_t *);
+static gboolean	  busy_timeout(gpointer);
 static icon_t	  *add_icon(drive_t *);
+static icon_t	  *lookup_icon(const char *);
 static drive_t	  *add_drive(drive_t *);
 static drive_t	  *lookupdrv(const char *);
 static drive_t	  *lookupdrv_from_mnt(const char *);
+static cmdtmpl_t  *drive_cmdtmpl(dsbcfg_t *, cmdtmpl_t **, int);
+static const struct drvcfg_s *drive_settings(drive_t *);
 static gboolean	  window_state_event(GtkWidget *, GdkEvent *, gpointer);
 static gboolean	  readevent(GIOChannel *, GIOCondition, gpointer);
 static gboolean	  icon_clicked(GtkWidget *, GdkEvent *, gpointer);
+static gboolean	  prof_first_icon(gpointer);
 static GdkPixbuf  *lookup_pixbuf(const char *);
+static GdkPixbuf  *render_icon(const struct disktypetbl_s *, int);
 static ctxmenu_t  *create_ctxmenu(icon_t *);
 static const char *errmsg(int);
 static GtkListStore  *create_icontbl(GtkListStore *);
@@ -168,6 +335,17 @@ struct drive_s {
 	char  *mntpt;		/* Mount point */
 	char  *fsname;		/* Filesystem name */
 	bool  mounted;		/* Whether drive is mounted. */
+	bool  hidden;		/* Whether drive is in the ignore list. */
+	/*
+	 * Settings resolved from the drive's config section and the
+	 * global section. See drive_settings().
+	 */
+	struct drvcfg_s {
+		u_int	  gen;		/* Config generation resolved from. */
+		bool	  autoplay;	/* Play the medium when inserted. */
+		cmdtmpl_t *fm;		/* Filemanager command. */
+		cmdtmpl_t *play;	/* Play command, or NULL. */
+	} settings;
 };
 
 struct dsbmdevent_s {
@@ -181,6 +359,8 @@ struct dsbmdevent_s {
 #define EVENT_SPEED	  'V'
 #define EVENT_ADD_DEVICE  '+'
 #define EVENT_DEL_DEVICE  '-'
+/* Not sent by DSBMD. Passed to reply functions of cancelled commands. */
+#define EVENT_CANCELLED	  'C'
 	char	 *command;	/* In case of a reply, the executed command. */
 	int	 mntcmderr;	/* Return code of external mount command. */
 	int	 code;		/* The error code */
@@ -278,15 +458,75 @@ static struct error_s {
 };
 #define NERRCODES (sizeof(errorcodes) / sizeof(struct error_s))
 
-#define NPROCS 16
-static struct process_s {
-	int   error;
-#define EXIT_ENOENT   127	  /* The command could not be found. */
-#define EXIT_EXEC_ERR 255	  /* Execution of the shell failed. */
-	int   saved_errno;	  /* errno set by execl(). */
-	char  *cmdstr;		  /* The command which was executed. */
-	pid_t pid;		  /* The command's PID. */
-} proctbl[NPROCS];
+/*
+ * Struct to represent a launched command. Running jobs are kept in a
+ * hash table keyed by their PID, finished jobs in a history list of
+ * limited length.
+ */
+#define JOB_HISTORY 32
+struct job_s {
+	int    status;		  /* Status as returned by waitpid(). */
+#define EXIT_ENOENT   127	  /* The shell couldn't find the command. */
+	bool   running;
+	char   *cmdstr;		  /* The command which was executed. */
+	pid_t  pid;		  /* The command's PID. */
+	gint64 start;		  /* Monotonic start time in µs. */
+	gint64 end;		  /* Monotonic end time in µs. */
+};
+static GQueue	  *jobhist;	  /* Finished jobs, most recent first. */
+static GHashTable *jobs;	  /* Running jobs. */
+
+/*
+ * Struct for the jobs window.
+ */
+enum {
+	JOB_COL_PID, JOB_COL_CMD, JOB_COL_STATUS, JOB_COL_TIME, JOB_NCOLS
+};
+static struct jobswin_s {
+	guint	     timer;	  /* Timer to update the durations. */
+	GtkWidget    *win;
+	GtkListStore *store;
+} jobswin;
+
+/*
+ * In-memory copy of the ~/.gtk-bookmarks file. The lines are kept in
+ * file order, and the bookmarked paths in a hash set. Changes are
+ * recorded, and written back after a short delay, so mounting several
+ * devices at once costs one write.
+ */
+#define BOOKMARK_FLUSH_DELAY 500  /* ms */
+static struct bookmarks_s {
+	guint	     timer;	  /* Pending flush. */
+	char	     *path;
+	GQueue	     *lines;	  /* Lines of the bookmarks file. */
+	GQueue	     *pending;	  /* Changes not yet written ("+/-path"). */
+	GHashTable   *set;	  /* Bookmarked paths. */
+	GFileMonitor *monitor;
+	struct stat  sb;	  /* File status after last read or write. */
+} bookmarks;
+
+/*
+ * Struct to represent a command template from the config file. Templates
+ * are compiled at config load into a list of literal text and field code
+ * segments. Templates without shell syntax beyond quoting are split into
+ * words, and executed directly. All other templates are executed by the
+ * shell, and the fields are quoted according to their quote context.
+ */
+#define FIELD_CODES "dmlfts"
+struct cmdtmpl_s {
+	bool shell;		  /* Template needs to be run by sh(1). */
+	int  nwords;		  /* # of words. */
+	int  nsegs;		  /* # of segments. */
+	char *str;		  /* Template string. */
+	char *buf;		  /* Buffer holding the literal text. */
+	struct tmplseg_s {
+		char   code;	  /* Field code, or '\0' for literal text. */
+		char   quote;	  /* Quote context of the field (shell only) */
+		int    word;	  /* Index of the word the segment belongs to. */
+		size_t len;	  /* Length of the literal text. */
+		char   *text;	  /* Literal text. */
+	} *segs;
+};
 
 /*
  * Struct to load pixbufs for device icons and context menu items.
@@ -294,11 +534,16 @@ static struct process_s {
 static struct pixbuftbl_s {
 	const char *id;
 	const int  iconsize;
+#define ICON_SIZE_WIN  32
 #define ICON_SIZE_ICON 46
 #define ICON_SIZE_MENU 16
+#define ICON_SIZE_EMBLEM (ICON_SIZE_ICON / 2)
 	GdkPixbuf  *icon;	/* Icons for menu and devices. */
 	const char *name[4];	/* Icon name with alternatives. */
 } pixbuftbl[] = {
+	{ "dsbmc",   ICON_SIZE_WIN,  NULL, { "drive-harddisk-usb",
+					     "drive-removable-media",
+					     "drive-harddisk",	     NULL } },
 	{ "MTP",     ICON_SIZE_ICON, NULL, { "multimedia-player",
 					     "drive-harddisk-usb",   NULL } },
 	{ "PTP",     ICON_SIZE_ICON, NULL, { "camera-photo",
@@ -323,7 +568,8 @@ static struct pixbuftbl_s {
 	{ "MMC",     ICON_SIZE_ICON, NULL, { "media-flash-sd-mmc",
 					     "media-flash",	     NULL } },
 	{ "FLOPPY",  ICON_SIZE_ICON, NULL, { "media-floppy",	     NULL } },
-	{ "mounted", ICON_SIZE_ICON, NULL, { "folder",		     NULL } },
+	{ "mounted", ICON_SIZE_EMBLEM, NULL, { "emblem-mounted",
+					     "emblem-default", "folder", NULL } },
 	{ "dvd",     ICON_SIZE_MENU, NULL, { "media-optical-dvd",
 					     "drive-optical",	     NULL } },
 	{ "cd",	     ICON_SIZE_MENU, NULL, { "media-optical-cd",
@@ -344,6 +590,36 @@ static struct pixbuftbl_s {
 };
 #define PIXBUFTBLSZ (sizeof(pixbuftbl) / sizeof(struct pixbuftbl_s))
 
+/*
+ * Structs to define the on-disk icon cache. The cache file holds the
+ * pre-scaled pixel data of all pixbuftbl icons as resolved for the current
+ * icon theme and scale factor. It is mapped into memory at startup, and the
+ * pixbufs are created directly from the mapped data. The stamp is a hash
+ * over the theme name, the scale factor, and the mtimes of the theme dirs.
+ */
+#define ICON_CACHE_MAGIC   0x44534243	/* "DSBC" */
+#define ICON_CACHE_VERSION 2
+#define ICON_CACHE_IDLEN   16
+#define ICON_CACHE_MAXDIM  1024		/* Max. icon width/height in pixels. */
+struct iconcache_hdr_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nentries;		/* # of entries following the header. */
+	int32_t	 scale;			/* Display scale factor. */
+	uint64_t stamp;			/* Theme hash the cache is valid for. */
+};
+
+struct iconcache_ent_s {
+	char	 id[ICON_CACHE_IDLEN];	/* pixbuftbl ID. */
+	int32_t	 size;			/* Requested icon size. */
+	int32_t	 width;			/* 0 if the icon couldn't be found. */
+	int32_t	 height;
+	int32_t	 rowstride;
+	int32_t	 alpha;			/* Whether the pixbuf has alpha. */
+	uint32_t len;			/* Length of the pixel data. */
+	uint64_t offset;		/* Offset of the pixel data in file. */
+};
+
 /*
  * Struct to create context menus for the device icons.  The order of the
  * following entries represent the order of the menu items in the context
@@ -387,6 +663,22 @@ struct disktypetbl_s {
 };
 #define NDSKTYPES (sizeof(disktypetbl) / sizeof(struct disktypetbl_s))
 
+/*
+ * Render cache for the composited device icons. Each icon is rendered
+ * only once per disk type, state, size and scale factor.
+ */
+enum {
+	ICON_STATE_NORMAL, ICON_STATE_MOUNTED, NICON_STATES
+};
+static struct rendercache_s {
+	u_char	  type;		/* Disk type. */
+	int	  state;	/* One of ICON_STATE_* */
+	int	  size;
+	int	  scale;
+	GdkPixbuf *pix;
+} *rendercache = NULL;
+static int nrendered = 0;
+
 /*
  * Struct to assign command names to command flags/IDs and a pixbuf.
  */
@@ -407,6 +699,7 @@ struct cmdtbl_s {
 enum MenuItems {
 	MENU_ITEM_MOUNT,
 	MENU_ITEM_UNMOUNT,
+	MENU_ITEM_CANCEL,
 	NMENU_ITEMS
 };
 struct ctxmenu_s {
@@ -414,6 +707,25 @@ struct ctxmenu_s {
 	GtkWidget *menuitems[NMENU_ITEMS];
 };
 
+/*
+ * Struct to define a command for DSBMD. Commands are queued per device
+ * and priority class. Interactive commands are the ones the user waits
+ * for. Background commands just refresh information.
+ */
+enum {
+	CMD_PRIO_INTERACTIVE, CMD_PRIO_BACKGROUND, NCMD_PRIOS
+};
+struct command_s {
+	char   cmd[128];	/* Command string to send to DSBMD */
+	void   (*re)(icon_t *);	/* Function to call on DSBMD reply */
+	icon_t *icon;		/* icon/device command  refers to. */
+	int    prio;		/* CMD_PRIO_* */
+	int    timeout;		/* Reply timeout config variable or -1. */
+	int    metric;		/* Index into metrics.cmd. */
+	gint64 queued;		/* Time the command was queued. */
+	gint64 sent;		/* Time the command was sent. */
+};
+
 /*
  * Struct to represent a device icon.
  */
@@ -424,10 +736,14 @@ struct icon_s {
 	GdkPixbuf   *pix_mounted; /* Icon pixbuf to use when mounted */
 	GdkPixbuf   *pix_normal;  /* Icon pixbuf to use when not mounted. */
 	GdkPixbuf   *pixbuf;	  /* Current icon pixbuf. */
+	GdkPixbuf   *pix_busy;	  /* Dimmed pixbuf shown while busy. */
 	GtkTreeIter iter;
+	int	    busy;	  /* # of commands waiting for a reply. */
+	guint	    busytimer;	  /* Timer to dim the icon. */
+	GQueue	    *cmds[NCMD_PRIOS]; /* Queued commands by priority. */
 };
 enum {
-	COL_NAME, COL_PIXBUF, COL_ICON, NUM_COLS
+	COL_NAME, COL_PIXBUF, COL_ICON, COL_SURFACE, NUM_COLS
 };
 
 /*
@@ -440,6 +756,7 @@ static struct mainwin_s {
 	int	       *height;	  /* Window's height */
 	GtkWidget      *icon_view;
 	GtkWidget      *statusbar;
+	GtkWidget      *menu;	  /* Menu of the tray icon and menu bar. */
 	GtkWindow      *win;	  /* Main window. */
 	GtkListStore   *store;	  /* Device icon grid. */
 	GtkStatusIcon  *tray_icon;
@@ -457,30 +774,145 @@ static struct settingsmenu_s {
 	char ***ignore_list;
 	struct settings_cmd_s {
 		const char *action;
-		char	   **cmdstr;
+		int	   var;		/* Command config variable. */
+		int	   autovar;	/* Autoplay config variable or -1. */
 		const char *iconid;
-		bool	   *autoplay;
 	} cmds[SETTINGS_NCMDS];
 } settingsmenu = {
 	.cmds = {
-		{ "Filemanager: ",	   NULL, "open", NULL },
-		{ "Play DVDs with: ",	   NULL, "dvd",  NULL },
-		{ "Play VCDs with: ",	   NULL, "vcd",  NULL },
-		{ "Play SVCDs with: ",	   NULL, "svcd", NULL },
-		{ "Play Audio CDs with: ", NULL, "cdda", NULL }
+		{ "Filemanager: ",	   -1, -1, "open" },
+		{ "Play DVDs with: ",	   -1, -1, "dvd"  },
+		{ "Play VCDs with: ",	   -1, -1, "vcd"  },
+		{ "Play SVCDs with: ",	   -1, -1, "svcd" },
+		{ "Play Audio CDs with: ", -1, -1, "cdda" }
 	}
 };
 
 /*
- * Struct to define a command queue. It makes sure commands
- * will be processed in the correct order. A command will only
- * be executed if the previous was processed.
+ * The command scheduler. DSBMD replies in order, and its replies don't
+ * name the device, so only one command is sent at a time. Interactive
+ * commands are always sent before background commands. Within a class,
+ * the devices with queued commands take turns, and the commands of a
+ * device are sent in order.
  */
-struct command_s {
-	char cmd[128];		/* Command string to send to DSBMD */
-	void (*re)(icon_t *);	/* Function to call on DSBMD reply */
-	icon_t *icon;		/* icon/device command  refers to. */
-} cmdq[CMDQSZ];
+static struct cmdsched_s {
+	bool	  stats;		/* Print wait times on exit. */
+	guint	  timer;		/* Reply timeout of 'cur'. */
+	GQueue	  *devs[NCMD_PRIOS];	/* Icons with queued commands. */
+	command_t *cur;			/* Command waiting for its reply. */
+	struct cmdwait_s {
+		u_long n;		/* # of commands sent. */
+		gint64 total;		/* Sum of the queue wait times (us). */
+		gint64 max;
+	} wait[NCMD_PRIOS];
+} cmdsched;
+
+/*
+ * Latency histograms. Bucket i counts the values v (in µs) with
+ * 2^(i - 1) <= v < 2^i. The last bucket also takes all larger values.
+ */
+#define NHISTBUCKETS 32
+struct hist_s {
+	u_long n;
+	gint64 max;
+	u_long bucket[NHISTBUCKETS];
+};
+
+/*
+ * Latency metrics of DSBMD commands and event processing. They are
+ * printed to stderr on SIGUSR1, shown in the diagnostics window, and
+ * written to the --metrics file on exit.
+ */
+enum {
+	MET_MOUNT, MET_UNMOUNT, MET_EJECT, MET_SIZE, MET_SPEED, MET_MDATTACH,
+	MET_OTHER, NMETCMDS
+};
+static struct metrics_s {
+	const char *path;	/* File to write the metrics to on exit. */
+	struct cmdmetric_s {
+		const char    *name;
+		struct hist_s wait;	/* Time spent in the queue. */
+		struct hist_s rtt;	/* Sent until reply read. */
+		struct hist_s handler;	/* Time in the reply function. */
+	} cmd[NMETCMDS];
+	u_long	      events[128];	/* # of events by type. */
+	struct hist_s parse;		/* Parsing an event line. */
+	struct hist_s dispatch;		/* Time in readevent(). */
+	struct hist_s icontbl;		/* Rebuilding the icon table. */
+	struct hist_s stall;		/* Main loop stalls. */
+} metrics = {
+	.cmd = {
+		[MET_MOUNT]    = { "mount"    },
+		[MET_UNMOUNT]  = { "unmount"  },
+		[MET_EJECT]    = { "eject"    },
+		[MET_SIZE]     = { "size"     },
+		[MET_SPEED]    = { "speed"    },
+		[MET_MDATTACH] = { "mdattach" },
+		[MET_OTHER]    = { "other"    }
+	}
+};
+
+/*
+ * Flight recorder. A ring buffer of the last protocol lines, events,
+ * commands and launches. Recording doesn't allocate memory. The buffer
+ * is printed on SIGUSR2, on fatal errors, and shown in the diagnostics
+ * window.
+ */
+#define FLIGHTREC_SIZE 256
+#define REC_LINE    '<'		/* Line read from DSBMD. */
+#define REC_CMD	    '>'		/* Command sent to DSBMD. */
+#define REC_EVENT   'E'		/* Parsed event. */
+#define REC_EXEC    'X'		/* Launched command. */
+#define REC_WARN    'W'		/* Protocol problem. */
+#define REC_STALL   'S'		/* Main loop stall. */
+static struct flightrec_s {
+	u_int n;			/* # of records ever written. */
+	struct record_s {
+		char   kind;		/* One of REC_* */
+		gint64 time;		/* Monotonic time in µs. */
+		char   text[120];
+	} rec[FLIGHTREC_SIZE];
+} flightrec;
+
+/*
+ * Main loop watchdog. A timer on the main loop counts heartbeats, and a
+ * thread reports when they stop for longer than the stall_threshold.
+ * Slow operations on the main thread are marked as sections, so the
+ * report can tell what was running. The watchdog is off by default, and
+ * the thread sleeps on 'cond' while it is off.
+ */
+#define HEARTBEAT_INTERVAL 250	/* ms */
+static struct watchdog_s {
+	gint	 beats;		/* Heartbeat counter. */
+	gint	 threshold;	/* Stall threshold in ms. 0 = off. */
+	GMutex	 lock;		/* Protects 'threshold'. */
+	GCond	 cond;		/* Signaled when 'threshold' changes. */
+	guint	 timer;		/* Heartbeat timer. */
+	gint64	 lastbeat;	/* Time of the last heartbeat. */
+	gpointer section;	/* Name of the running section or NULL. */
+	gpointer stallsect;	/* Section the thread found stalled. */
+	GThread	 *thread;
+} watchdog;
+
+/*
+ * Struct for the diagnostics window.
+ */
+static struct diagwin_s {
+	guint	      timer;	  /* Timer to update the metrics. */
+	GtkWidget     *win;
+	GtkTextBuffer *buf;
+} diagwin;
+
+/*
+ * Commands we gave up waiting for, oldest first. Their replies may
+ * still arrive, and must not be taken for the replies to the commands
+ * sent after them.
+ */
+struct lostcmd_s {
+	char *cmd;			/* Command string without newline. */
+	char *dev;			/* Device the command refers to. */
+};
+static GQueue *lostcmds;
 
 
 /*
@@ -498,7 +930,9 @@ enum {
 	CFG_PLAY_CDDA, CFG_PLAY_DVD, CFG_PLAY_VCD, CFG_PLAY_SVCD,
 	CFG_FILEMANAGER, CFG_DVD_AUTO, CFG_VCD_AUTO, CFG_SVCD_AUTO,
 	CFG_CDDA_AUTO, CFG_WIDTH, CFG_HEIGHT, CFG_POS_X, CFG_POS_Y,
-	CFG_HIDE, CFG_NVARS
+	CFG_HIDE, CFG_SYNC, CFG_BUSY_DELAY, CFG_TIMEOUT_MOUNT,
+	CFG_TIMEOUT_UNMOUNT, CFG_TIMEOUT_EJECT, CFG_TIMEOUT_SPEED,
+	CFG_TIMEOUT_SIZE, CFG_STALL_THRESHOLD, CFG_NVARS
 };
 
 static dsbcfg_vardef_t vardefs[] = {
@@ -515,11 +949,104 @@ static dsbcfg_vardef_t vardefs[] = {
   { "vcd_auto",    DSBCFG_VAR_BOOLEAN, CFG_VCD_AUTO,    DSBCFG_VAL(false)    },
   { "svcd_auto",   DSBCFG_VAR_BOOLEAN, CFG_SVCD_AUTO,   DSBCFG_VAL(false)    },
   { "cdda_auto",   DSBCFG_VAR_BOOLEAN, CFG_CDDA_AUTO,   DSBCFG_VAL(false)    },
-  { "ignore",	   DSBCFG_VAR_STRINGS, CFG_HIDE,	DSBCFG_VAL((char **)NULL)     }
+  { "ignore",	   DSBCFG_VAR_STRINGS, CFG_HIDE,	DSBCFG_VAL((char **)NULL)     },
+  /* How to write the config file: "none", "file" (fsync) or "dir". */
+  { "sync_writes", DSBCFG_VAR_STRING,  CFG_SYNC,	DSBCFG_VAL("file")   },
+  /* Dim an icon if a command on it takes longer than this (ms). */
+  { "busy_delay",  DSBCFG_VAR_INTEGER, CFG_BUSY_DELAY,  DSBCFG_VAL(250)      },
+  /* Seconds to wait for DSBMD's reply to a command. 0 waits forever. */
+  { "mount_timeout",   DSBCFG_VAR_INTEGER, CFG_TIMEOUT_MOUNT,   DSBCFG_VAL(60) },
+  { "unmount_timeout", DSBCFG_VAR_INTEGER, CFG_TIMEOUT_UNMOUNT, DSBCFG_VAL(60) },
+  { "eject_timeout",   DSBCFG_VAR_INTEGER, CFG_TIMEOUT_EJECT,   DSBCFG_VAL(60) },
+  { "speed_timeout",   DSBCFG_VAR_INTEGER, CFG_TIMEOUT_SPEED,   DSBCFG_VAL(30) },
+  { "size_timeout",    DSBCFG_VAR_INTEGER, CFG_TIMEOUT_SIZE,    DSBCFG_VAL(10) },
+  /* Report main loop stalls longer than this (ms). 0 turns it off. */
+  { "stall_threshold", DSBCFG_VAR_INTEGER, CFG_STALL_THRESHOLD,
+    DSBCFG_VAL(0) }
+};
+
+/*
+ * Priority class and reply timeout config variable by DSBMD command.
+ * Commands not listed are interactive, and have no timeout.
+ */
+static const struct cmdprop_s {
+	const char *name;
+	int	   prio;
+	int	   timeout;
+} cmdprops[] = {
+	{ "mount",   CMD_PRIO_INTERACTIVE, CFG_TIMEOUT_MOUNT   },
+	{ "unmount", CMD_PRIO_INTERACTIVE, CFG_TIMEOUT_UNMOUNT },
+	{ "eject",   CMD_PRIO_INTERACTIVE, CFG_TIMEOUT_EJECT   },
+	{ "speed",   CMD_PRIO_INTERACTIVE, CFG_TIMEOUT_SPEED   },
+	{ "size",    CMD_PRIO_BACKGROUND,  CFG_TIMEOUT_SIZE    }
+};
+#define NCMDPROPS (sizeof(cmdprops) / sizeof(cmdprops[0]))
+
+/*
+ * Config variables holding command templates.
+ */
+static const int cmdtmplvars[] = {
+	CFG_FILEMANAGER, CFG_PLAY_CDDA, CFG_PLAY_DVD, CFG_PLAY_VCD,
+	CFG_PLAY_SVCD
+};
+#define NCMDTMPLS (sizeof(cmdtmplvars) / sizeof(cmdtmplvars[0]))
+
+/*
+ * Functions to call if config variables changed. Each function is called
+ * once per change with an array of flags telling which variables changed.
+ */
+static void (*const cfgsubs[CFG_NVARS])(const bool *) = {
+	[CFG_FILEMANAGER] = cmdtmpls_changed,
+	[CFG_PLAY_CDDA]	  = cmdtmpls_changed,
+	[CFG_PLAY_DVD]	  = cmdtmpls_changed,
+	[CFG_PLAY_VCD]	  = cmdtmpls_changed,
+	[CFG_PLAY_SVCD]	  = cmdtmpls_changed,
+	[CFG_DVD_AUTO]	  = autoplay_changed,
+	[CFG_VCD_AUTO]	  = autoplay_changed,
+	[CFG_SVCD_AUTO]	  = autoplay_changed,
+	[CFG_CDDA_AUTO]	  = autoplay_changed,
+	[CFG_WIDTH]	  = geometry_changed,
+	[CFG_HEIGHT]	  = geometry_changed,
+	[CFG_POS_X]	  = geometry_changed,
+	[CFG_POS_Y]	  = geometry_changed,
+	[CFG_HIDE]	  = ignore_list_changed,
+	[CFG_SYNC]	  = sync_changed,
+	[CFG_STALL_THRESHOLD] = watchdog_changed
+};
+
+/*
+ * Struct to record the startup phases for --profile-startup. Each phase
+ * is marked with a monotonic timestamp and the max. RSS at its end.
+ */
+enum {
+	PROF_START, PROF_GTK_INIT, PROF_LOCK, PROF_CFG_READ, PROF_CONNECT,
+	PROF_DRIVE_LIST, PROF_PIXBUFS, PROF_JOIN, PROF_MAINWIN,
+	PROF_FIRST_ICON, NPROF_PHASES
+};
+static struct profile_s {
+	bool	   enabled;
+	const char *json;		 /* JSON output file or NULL. */
+	struct prof_phase_s {
+		const char	*name;
+		bool		done;
+		long		maxrss;	 /* Max. RSS in KB. */
+		struct timespec ts;
+	} phase[NPROF_PHASES];
+} profile = {
+	.phase = {
+		[PROF_START]	  = { "start"      },
+		[PROF_GTK_INIT]	  = { "gtk_init"   },
+		[PROF_LOCK]	  = { "lock"	   },
+		[PROF_CFG_READ]	  = { "config"     },
+		[PROF_CONNECT]	  = { "connect"    },
+		[PROF_DRIVE_LIST] = { "drive_list" },
+		[PROF_PIXBUFS]	  = { "pixbufs"    },
+		[PROF_JOIN]	  = { "join"	   },
+		[PROF_MAINWIN]	  = { "mainwin"    },
+		[PROF_FIRST_ICON] = { "first_icon" }
+	}
 };
 
-static int	cmdqlen = 0;	  /* # of commands in command queue. */
-static int	cmdqidx = 0;	  /* # current command to exec. in queue */
 static int      nicons  = 0;	  /* # of device icons. */
 static int      ndrives = 0;	  /* # of drives. */
 static FILE     *sock;		  /* Socket connected to dsbmd. */
@@ -527,247 +1054,983 @@ static icon_t   **icons  = NULL;  /* List of device icons. */
 static drive_t  **drives = NULL;  /* List of drives. */
 static dsbcfg_t *cfg	 = NULL;
 
-static void
+/*
+ * Deferred writing of the config file.
+ */
+#define CFG_FLUSH_DELAY 1000	/* ms */
+static struct cfgflush_s {
+	guint timer;		/* Debounce timer. */
+	guint idle;		/* Idle source writing the file. */
+} cfgflush;
+
+/*
+ * Monitor to reload the config file if another program changed it.
+ */
+#define CFG_RELOAD_DELAY 250	/* ms */
+static struct cfgmon_s {
+	char	     *path;
+	guint	     timer;	/* Timer to coalesce change events. */
+	struct stat  sb;	/* File status after our last read/write. */
+	GFileMonitor *monitor;
+} cfgmon;
+/*
+ * The config file is read, and the icons are loaded from the icon cache
+ * on worker threads while the main thread connects to dsbmd, and reads
+ * the drive list. Both threads are joined before the first icon is shown.
+ * GTK is not thread-safe, so if the cache is stale, the icons are resolved
+ * through the icon theme on the main thread after joining.
+ */
+static struct startup_s {
+	int		scale;		/* Icon scale factor. */
+	int		ndirs;		/* # of dirs in 'dirs'. */
+	int		cfgerrno;	/* errno set by dsbcfg_read_r(). */
+	char		*theme;		/* Icon theme name. */
+	char		**dirs;		/* Icon theme search path. */
+	uint64_t	stamp;		/* Icon cache stamp. */
+	GThread		*cfgthr;
+	GThread		*iconthr;
+	dsbcfg_parser_t *cfgctx;	/* Parser context of cfgthr. */
+} startup;
+static cmdtmpl_t *cmdtmpls[CFG_NVARS];	/* Compiled command templates. */
+static GHashTable *sectmpls;		/* Templates of device sections. */
+static u_int	cfggen = 1;		/* Incremented on config changes. */
+static int	iconscale = 1;	  /* Display scale factor of the icons. */
+
+/*
+ * Adds a command to the device's queue, and sends it if no other command
+ * is waiting for a reply. Returns -1 if the device's queue is full.
+ */
+static int
 sndcmd(void (*re)(icon_t *), icon_t *icon, const char *cmd, ...)
 {
-	va_list ap;
+	int	  i;
+	GList	  *l;
+	size_t	  len;
+	GQueue	  *q;
+	va_list	  ap;
+	command_t *cp;
 	
-	if (cmdqlen == CMDQSZ)
-		/* Command queue is full. Just ignore further commands. */
-		return;
+	if ((cp = malloc(sizeof(command_t))) == NULL)
+		xerr(mainwin.win, EXIT_FAILURE, "malloc()");
 	va_start(ap, cmd);
-	(void)vsnprintf(cmdq[cmdqlen].cmd, sizeof(cmdq[cmdqlen].cmd), cmd, ap);
-	cmdq[cmdqlen].re   = re;
-	cmdq[cmdqlen].icon = icon;
-
-	if (cmdqlen++ == 0) {
-		/* First command in queue. */
-		cmdqidx = 0;
-		(void)fputs(cmdq[0].cmd, sock);
-	}
-}
-
-int
-main(int argc, char *argv[])
-{
-	int			  ch, i, lockfd;
-	gint	      iotag;
-	char	      *p, *path, path_lock[PATH_MAX];
-	sigset_t      sigmask;
-	GIOChannel    *ioc;
-	struct passwd *pw;
-
-#ifdef WITH_GETTEXT
-	(void)setlocale(LC_ALL, "");
-	(void)bindtextdomain(PROGRAM, PATH_LOCALE);
-	(void)textdomain(PROGRAM);
-#endif
-	gtk_init(&argc, &argv);
-
-	mainwin.win_state = GDK_WINDOW_STATE_ABOVE;
-	while ((ch = getopt(argc, argv, "ih")) != -1) {
-		switch (ch) {
-		case 'i':
-			/* Start as tray icon. */
-			mainwin.win_state = GDK_WINDOW_STATE_WITHDRAWN;
+	(void)vsnprintf(cp->cmd, sizeof(cp->cmd), cmd, ap);
+	va_end(ap);
+	cp->re	    = re;
+	cp->icon    = icon;
+	cp->prio    = CMD_PRIO_INTERACTIVE;
+	cp->timeout = -1;
+	cp->metric  = metric_index(cp->cmd);
+	cp->queued  = g_get_monotonic_time();
+	len = strcspn(cp->cmd, " \n");
+	for (i = 0; i < NCMDPROPS; i++) {
+		if (strlen(cmdprops[i].name) == len &&
+		    strncmp(cmdprops[i].name, cp->cmd, len) == 0) {
+			cp->prio    = cmdprops[i].prio;
+			cp->timeout = cmdprops[i].timeout;
 			break;
-		case '?':
-		case 'h':
-			usage();
 		}
 	}
-	argc -= optind;
-	argv += optind;
-
-	if ((pw = getpwuid(getuid())) == NULL)
-		xerr(NULL, EXIT_FAILURE, "getpwuid()");
-        /* Check if another instance is already running. */
-	(void)snprintf(path_lock, sizeof(path_lock), "%s/%s", pw->pw_dir,
-	    PATH_LOCK);
-	endpwent();
-	if ((lockfd = open(path_lock, O_WRONLY | O_CREAT, 0600)) == -1)
-		xerr(NULL, EXIT_FAILURE, "open(%s)", path_lock);
-	if (flock(lockfd, LOCK_EX | LOCK_NB) == -1) {
-		if (errno == EWOULDBLOCK) {
-			while (argc--)
-				(void)create_mddev(argv[argc]);
-			exit(EXIT_SUCCESS);
+	q = icon->cmds[cp->prio];
+	if (g_queue_get_length(q) >= CMDQSZ) {
+		/* Command queue is full. Just ignore further commands. */
+		free(cp);
+		return (-1);
+	}
+	if (cp->prio == CMD_PRIO_BACKGROUND) {
+		/* The reply to the same queued command will do. */
+		for (l = q->head; l != NULL; l = l->next) {
+			if (strcmp(((command_t *)l->data)->cmd, cp->cmd) == 0) {
+				free(cp);
+				return (0);
+			}
 		}
-		xerr(NULL, EXIT_FAILURE, "flock(%s)", path_lock);
 	}
-	while (argc--)
-		(void)create_mddev(argv[argc]);
-	if (sock != NULL)
-		(void)fclose(sock);
-
-	cfg = dsbcfg_read(PROGRAM, PATH_CONFIG, vardefs, CFG_NVARS);
-	if (cfg == NULL && errno == ENOENT) {
-		cfg = dsbcfg_new(NULL, vardefs, CFG_NVARS);
-		if (cfg == NULL)
-			xerrx(NULL, EXIT_FAILURE, "%s", dsbcfg_strerror());
-	} else if (cfg == NULL)
-		xerrx(NULL, EXIT_FAILURE, "%s", dsbcfg_strerror());
-
-	mainwin.posx   = &dsbcfg_getval(cfg, CFG_POS_X).integer;
-	mainwin.posy   = &dsbcfg_getval(cfg, CFG_POS_Y).integer;
-	mainwin.width  = &dsbcfg_getval(cfg, CFG_WIDTH).integer;
-	mainwin.height = &dsbcfg_getval(cfg, CFG_HEIGHT).integer;
+	if (g_queue_is_empty(q))
+		g_queue_push_tail(cmdsched.devs[cp->prio], icon);
+	g_queue_push_tail(q, cp);
+	DTRACE_PROBE2(dsbmc, cmd__queue, cp->cmd, cp->prio);
+	if (cmdsched.cur == NULL)
+		send_cmd();
+	return (0);
+}
 
-	settingsmenu.cmds[SETTINGS_FM].cmdstr =
-	    &dsbcfg_getval(cfg, CFG_FILEMANAGER).string;
-
-	settingsmenu.cmds[SETTINGS_DVD].autoplay =
-	    (bool *)&dsbcfg_getval(cfg, CFG_DVD_AUTO).boolean;
-	settingsmenu.cmds[SETTINGS_DVD].cmdstr = 
-	    &dsbcfg_getval(cfg, CFG_PLAY_DVD).string;
-
-	settingsmenu.cmds[SETTINGS_VCD].autoplay =
-	    (bool *)&dsbcfg_getval(cfg, CFG_VCD_AUTO).boolean;
-	settingsmenu.cmds[SETTINGS_VCD].cmdstr = 
-	    &dsbcfg_getval(cfg, CFG_PLAY_VCD).string;
-
-	settingsmenu.cmds[SETTINGS_SVCD].autoplay =
-	    (bool *)&dsbcfg_getval(cfg, CFG_SVCD_AUTO).boolean;
-	settingsmenu.cmds[SETTINGS_SVCD].cmdstr = 
-	    &dsbcfg_getval(cfg, CFG_PLAY_SVCD).string;
-
-	settingsmenu.cmds[SETTINGS_CDDA].autoplay =
-	    (bool *)&dsbcfg_getval(cfg, CFG_CDDA_AUTO).boolean;
-	settingsmenu.cmds[SETTINGS_CDDA].cmdstr = 
-	    &dsbcfg_getval(cfg, CFG_PLAY_CDDA).string;
-	settingsmenu.ignore_list =
-	    &dsbcfg_getval(cfg, CFG_HIDE).strings;
-	path = PATH_DSBMD_SOCKET;
-	for (i = 0; i < 10 && (sock = uconnect(path)) == NULL; i++) {
-		if (errno == EINTR || errno == ECONNREFUSED)
-			(void)sleep(1);
-		else
-			xerr(NULL, EXIT_FAILURE, "Couldn't connect to DSBMD");
+/*
+ * Sends the next command to DSBMD, and starts its reply timer.
+ */
+static void
+send_cmd()
+{
+	int		 prio, secs;
+	gint64		 wait;
+	icon_t		 *icon;
+	command_t	 *cp;
+	struct cmdwait_s *wp;
+
+	for (prio = 0, icon = NULL; prio < NCMD_PRIOS; prio++) {
+		if ((icon = g_queue_pop_head(cmdsched.devs[prio])) != NULL)
+			break;
 	}
-	if (i == 10)
-		xerr(NULL, EXIT_FAILURE, "Couldn't connect to DSBMD");
+	if (icon == NULL)
+		return;
+	cp = g_queue_pop_head(icon->cmds[prio]);
+	/* Let the other devices take their turn first. */
+	if (!g_queue_is_empty(icon->cmds[prio]))
+		g_queue_push_tail(cmdsched.devs[prio], icon);
+	wp = &cmdsched.wait[prio];
+	cp->sent = g_get_monotonic_time();
+	wait = cp->sent - cp->queued;
+	hist_add(&metrics.cmd[cp->metric].wait, wait);
+	wp->n++;
+	wp->total += wait;
+	if (wait > wp->max)
+		wp->max = wait;
+	cmdsched.cur = cp;
+	record(REC_CMD, "%s", cp->cmd);
+	DTRACE_PROBE2(dsbmc, cmd__send, metrics.cmd[cp->metric].name, cp->cmd);
+	(void)fputs(cp->cmd, sock);
+	secs = cp->timeout >= 0 ? dsbcfg_getval(cfg, cp->timeout).integer : 0;
+	if (secs > 0)
+		cmdsched.timer = g_timeout_add_seconds(secs, cmd_timeout, NULL);
+}
 
-	/* Get the drive list from dsbmd. */
-	for (ndrives = 0, p = readln(true); p[0] != '='; p = readln(true)) {
-		if (parse_dsbmdevent(p) == -1)
-			continue;
-		if (dsbmdevent.type == EVENT_ADD_DEVICE) {
-			add_drive(&dsbmdevent.drvinfo);
-		} else if (dsbmdevent.type == EVENT_ERROR_MSG) {
-			if (dsbmdevent.code != ERR_PERMISSION_DENIED)
-				continue;
-			xerrx(NULL, EXIT_FAILURE,
-			    _("You are not allowed to connect to DSBMD"));
-		} else if (dsbmdevent.type == EVENT_SHUTDOWN) {
-			xerrx(NULL, EXIT_FAILURE, _("DSBMD just shut down."));
-		}
-	}
-	ioc   = g_io_channel_unix_new(fileno(sock));
-	iotag = g_io_add_watch(ioc, G_IO_IN, readevent, NULL);
+/*
+ * Frees the sent command, and sends the next one.
+ */
+static void
+finish_cmd()
+{
+	if (cmdsched.timer > 0)
+		(void)g_source_remove(cmdsched.timer);
+	cmdsched.timer = 0;
+	free(cmdsched.cur);
+	cmdsched.cur = NULL;
+	send_cmd();
+}
 
-	(void)signal(SIGCHLD, catch_child);
-	(void)signal(SIGTERM, cleanup);
-	(void)signal(SIGINT, cleanup);
-	(void)signal(SIGHUP, cleanup);
-	(void)signal(SIGQUIT, cleanup);
+/*
+ * Calls the reply function of the given command with a reply of the
+ * given type and error code made up by us.
+ */
+static void
+fake_reply(command_t *cp, char type, int code)
+{
+	struct dsbmdevent_s saved;
+
+	/* We may be called while processing another event. */
+	saved = dsbmdevent;
+	(void)memset(&dsbmdevent, 0, sizeof(dsbmdevent));
+	dsbmdevent.type = type;
+	dsbmdevent.code = code;
+	cp->re(cp->icon);
+	dsbmdevent = saved;
+}
 
-	/* Init proc table */
-	for (i = 0; i < NPROCS; i++)
-		proctbl[i].pid = -1;
+/*
+ * Stops waiting for the reply to the sent command, and sends the next
+ * one. DSBMD can't cancel a command, so its reply may still arrive.
+ */
+static void
+abandon_cmd(char type, int code)
+{
+	command_t	 *cp = cmdsched.cur;
+	struct lostcmd_s *lp;
+
+	lp = g_malloc(sizeof(*lp));
+	lp->cmd = g_strndup(cp->cmd, strcspn(cp->cmd, "\n"));
+	lp->dev = g_strdup(cp->icon->drvp->dev);
+	g_queue_push_tail(lostcmds, lp);
+	fake_reply(cp, type, code);
+	finish_cmd();
+}
 
-	create_mainwin();
+static gboolean
+cmd_timeout(gpointer unused)
+{
+	cmdsched.timer = 0;
+	abandon_cmd(EVENT_ERROR_MSG, ERR_TIMEOUT);
 
-	for (;;) {
-		gtk_main();
-		/* Block SIGCHLD */
-		sigemptyset(&sigmask); sigaddset(&sigmask, SIGCHLD);
-		sigprocmask(SIG_BLOCK, &sigmask, NULL);
+	return (FALSE);
+}
 
-		for (i = 0; i < NPROCS; i++) {
-			if (proctbl[i].pid == -1)
-				continue;
-			if (proctbl[i].error == EXIT_ENOENT) {
-				/* We couldn't execute the program. */
-				errno = ENOENT;
-				xwarn(mainwin.win,
-				    _("Couldn't execute command \"%s\""),
-				    proctbl[i].cmdstr);
-				free(proctbl[i].cmdstr);
-				proctbl[i].pid = -1;
-			} else if (proctbl[i].error == EXIT_EXEC_ERR) {
-				errno = proctbl[i].saved_errno;
-				xwarn(mainwin.win,
-				    _("Failed to execute shell \"%s\""),
-				    _PATH_BSHELL);
-				free(proctbl[i].cmdstr);
-				proctbl[i].pid = -1;
-			}
+/*
+ * Removes all commands for the given icon from the queue.
+ */
+static void
+cancel_cmds(icon_t *icon)
+{
+	int	  prio;
+	command_t *cp;
+
+	for (prio = 0; prio < NCMD_PRIOS; prio++) {
+		(void)g_queue_remove(cmdsched.devs[prio], icon);
+		while ((cp = g_queue_pop_head(icon->cmds[prio])) != NULL) {
+			fake_reply(cp, EVENT_CANCELLED, 0);
+			free(cp);
 		}
-		/* Unblock SIGCHLD. */
-		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
 	}
+	if (cmdsched.cur != NULL && cmdsched.cur->icon == icon)
+		abandon_cmd(EVENT_CANCELLED, 0);
 }
 
+/*
+ * Prints how long the commands of each priority class waited in the
+ * queue before they were sent.
+ */
 static void
-usage()
+print_queue_stats()
 {
-	(void)printf("Usage: %s [-ih] [<disk image> ...]\n" \
-		     "   -i: Start %s as tray icon\n", PROGRAM, PROGRAM);
-	exit(EXIT_FAILURE);
+	int		 prio;
+	struct cmdwait_s *wp;
+	const char	 *names[NCMD_PRIOS] = { "interactive", "background" };
+
+	(void)fprintf(stderr, "%-12s %8s %14s %14s\n", "class", "sent",
+	    "avg.wait(ms)", "max.wait(ms)");
+	for (prio = 0; prio < NCMD_PRIOS; prio++) {
+		wp = &cmdsched.wait[prio];
+		(void)fprintf(stderr, "%-12s %8lu %14.3f %14.3f\n",
+		    names[prio], wp->n, wp->n > 0 ?
+		    wp->total / 1000.0 / wp->n : 0.0, wp->max / 1000.0);
+	}
 }
 
+/*
+ * Adds a record to the flight recorder, overwriting the oldest one. A
+ * trailing newline is dropped.
+ */
 static void
-create_mainwin()
+record(char kind, const char *fmt, ...)
 {
-	GdkPixbuf *icon;
-	GtkWidget *menu, *root_menu, *menu_bar, *item, *sw, *image, *vbox;
+	size_t		len;
+	va_list		ap;
+	struct record_s *rp;
+
+	rp = &flightrec.rec[flightrec.n++ % FLIGHTREC_SIZE];
+	rp->kind = kind;
+	rp->time = g_get_monotonic_time();
+	va_start(ap, fmt);
+	(void)vsnprintf(rp->text, sizeof(rp->text), fmt, ap);
+	va_end(ap);
+	if ((len = strlen(rp->text)) > 0 && rp->text[len - 1] == '\n')
+		rp->text[len - 1] = '\0';
+}
 
-	if ((icon = load_icon(32, "drive-harddisk-usb",
-	    "drive-removable-media", "drive-harddisk", NULL)) == NULL) {
-		icon = load_icon(32, "image-missing", NULL);
-	}
-	mainwin.win = GTK_WINDOW(gtk_window_new(GTK_WINDOW_TOPLEVEL));
-	gtk_window_set_default_size(mainwin.win, *mainwin.width,
-	    *mainwin.height);
-	gtk_window_set_title(mainwin.win, TITLE);
-	gtk_window_set_resizable(mainwin.win, TRUE);
-	gtk_window_set_icon(mainwin.win, icon);
+/*
+ * Formats the i-th oldest record still in the buffer. The time is given
+ * relative to 'now' in seconds.
+ */
+static void
+format_record(u_int i, gint64 now, char *buf, size_t size)
+{
+	struct record_s *rp;
 
-	load_pixbufs();
-	create_icon_list();
+	if (flightrec.n > FLIGHTREC_SIZE)
+		i += flightrec.n - FLIGHTREC_SIZE;
+	rp = &flightrec.rec[i % FLIGHTREC_SIZE];
+	(void)snprintf(buf, size, "%10.3f %c %s\n",
+	    (rp->time - now) / 1000000.0, rp->kind, rp->text);
+}
 
-	/* Create the menu for the menu bar and the tray icon. */
-	menu  = gtk_menu_new();
-	image = gtk_image_new_from_icon_name("preferences-system", GTK_ICON_SIZE_MENU);
-	item  = gtk_image_menu_item_new_with_mnemonic(_("_Preferences"));
-	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), image);
-	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
-	g_signal_connect(G_OBJECT(item), "activate",
+static void
+print_flightrec()
+{
+	char   buf[160];
+	u_int  i, n;
+	gint64 now;
+
+	now = g_get_monotonic_time();
+	n = MIN(flightrec.n, FLIGHTREC_SIZE);
+	(void)fprintf(stderr, "Last %u of %u records:\n", n, flightrec.n);
+	for (i = 0; i < n; i++) {
+		format_record(i, now, buf, sizeof(buf));
+		(void)fputs(buf, stderr);
+	}
+}
+
+static gboolean
+dump_flightrec(gpointer unused)
+{
+	print_flightrec();
+
+	return (TRUE);
+}
+
+/*
+ * Marks the start of a section which may block the main loop. Returns
+ * the enclosing section to pass to wd_leave().
+ */
+static const char *
+wd_enter(const char *name)
+{
+	const char *prev;
+
+	prev = g_atomic_pointer_get(&watchdog.section);
+	g_atomic_pointer_set(&watchdog.section, (gpointer)name);
+
+	return (prev);
+}
+
+static void
+wd_leave(const char *prev)
+{
+	g_atomic_pointer_set(&watchdog.section, (gpointer)prev);
+}
+
+static void
+watchdog_changed(const bool *unused)
+{
+	int threshold;
+
+	threshold = MAX(dsbcfg_getval(cfg, CFG_STALL_THRESHOLD).integer, 0);
+	g_mutex_lock(&watchdog.lock);
+	watchdog.threshold = threshold;
+	g_cond_signal(&watchdog.cond);
+	g_mutex_unlock(&watchdog.lock);
+	if (threshold > 0 && watchdog.timer == 0) {
+		watchdog.lastbeat = 0;
+		watchdog.timer = g_timeout_add(HEARTBEAT_INTERVAL, heartbeat,
+		    NULL);
+		if (watchdog.thread == NULL) {
+			watchdog.thread = g_thread_new("watchdog",
+			    watchdog_thread, NULL);
+		}
+	} else if (threshold == 0 && watchdog.timer > 0) {
+		(void)g_source_remove(watchdog.timer);
+		watchdog.timer = 0;
+	}
+}
+
+/*
+ * Called on the main loop. A late heartbeat means the main loop stalled.
+ * The stall is recorded here, because the recorder and the metrics
+ * belong to the main thread.
+ */
+static gboolean
+heartbeat(gpointer unused)
+{
+	gint64	   now, gap;
+	const char *sect;
+
+	now = g_get_monotonic_time();
+	gap = (now - watchdog.lastbeat) / 1000 - HEARTBEAT_INTERVAL;
+	sect = g_atomic_pointer_get(&watchdog.stallsect);
+	if (watchdog.lastbeat > 0 && gap >= watchdog.threshold) {
+		hist_add(&metrics.stall, gap * 1000);
+		record(REC_STALL, "Main loop stalled for %ld ms in %s",
+		    (long)gap, sect != NULL ? sect : "-");
+	}
+	g_atomic_pointer_set(&watchdog.stallsect, NULL);
+	watchdog.lastbeat = now;
+	g_atomic_int_inc(&watchdog.beats);
+
+	return (TRUE);
+}
+
+/*
+ * Watches the heartbeats. A stall is reported once, while it lasts, so
+ * it is seen even if the main loop never recovers. While the watchdog is
+ * off, the thread waits for it to be turned on again.
+ */
+static gpointer
+watchdog_thread(gpointer unused)
+{
+	gint	   beats, last, threshold;
+	bool	   reported;
+	gint64	   now, since, stalled;
+	const char *sect;
+
+	last = 0; since = 0;
+	for (reported = false;; g_usleep(HEARTBEAT_INTERVAL * 1000)) {
+		g_mutex_lock(&watchdog.lock);
+		if (watchdog.threshold == 0) {
+			while (watchdog.threshold == 0)
+				g_cond_wait(&watchdog.cond, &watchdog.lock);
+			since = 0;
+		}
+		threshold = watchdog.threshold;
+		g_mutex_unlock(&watchdog.lock);
+
+		now = g_get_monotonic_time();
+		beats = g_atomic_int_get(&watchdog.beats);
+		if (beats != last || since == 0) {
+			last = beats; since = now; reported = false;
+			continue;
+		}
+		stalled = (now - since) / 1000 - HEARTBEAT_INTERVAL;
+		if (reported || stalled < threshold)
+			continue;
+		if ((sect = g_atomic_pointer_get(&watchdog.section)) == NULL)
+			sect = "uninstrumented code";
+		g_atomic_pointer_set(&watchdog.stallsect, (gpointer)sect);
+		warnx("Main loop stalled for %ld ms in %s", (long)stalled,
+		    sect);
+		reported = true;
+	}
+	return (NULL);
+}
+
+/*
+ * Returns the index into metrics.cmd for the given command string.
+ */
+static int
+metric_index(const char *cmd)
+{
+	int    i;
+	size_t len;
+
+	len = strcspn(cmd, " \n");
+	for (i = 0; i < MET_OTHER; i++) {
+		if (strlen(metrics.cmd[i].name) == len &&
+		    strncmp(metrics.cmd[i].name, cmd, len) == 0)
+			return (i);
+	}
+	return (MET_OTHER);
+}
+
+static void
+hist_add(struct hist_s *hp, gint64 usecs)
+{
+	int i;
+
+	if (usecs < 0)
+		usecs = 0;
+	for (i = 0; i < NHISTBUCKETS - 1 && (usecs >> i) > 0; i++)
+		;
+	hp->bucket[i]++;
+	hp->n++;
+	if (usecs > hp->max)
+		hp->max = usecs;
+}
+
+/*
+ * Returns the given percentile in ms. The value is the upper bound of the
+ * bucket it falls into, but never more than the max.
+ */
+static double
+hist_pct(const struct hist_s *hp, int pct)
+{
+	int    i;
+	u_long n, rank;
+
+	if (hp->n == 0)
+		return (0);
+	rank = (hp->n * pct + 99) / 100;
+	for (i = 0, n = 0; i < NHISTBUCKETS - 1; i++) {
+		if ((n += hp->bucket[i]) >= rank)
+			break;
+	}
+	return (MIN((gint64)1 << i, hp->max) / 1000.0);
+}
+
+static void
+add_hist_row(GString *str, const char *name, const char *stage,
+	const struct hist_s *hp)
+{
+	g_string_append_printf(str, "%-9s %-8s %7lu %9.3f %9.3f %9.3f %9.3f\n",
+	    name, stage, hp->n, hist_pct(hp, 50), hist_pct(hp, 95),
+	    hist_pct(hp, 99), hp->max / 1000.0);
+}
+
+/*
+ * Returns the metrics as text. Percentiles and max are in ms.
+ */
+static GString *
+metrics_report()
+{
+	int		   i;
+	GString		   *str;
+	struct cmdmetric_s *mp;
+
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "%-9s %-8s %7s %9s %9s %9s %9s\n",
+	    "what", "stage", "count", "p50", "p95", "p99", "max");
+	for (i = 0; i < NMETCMDS; i++) {
+		mp = &metrics.cmd[i];
+		if (mp->wait.n == 0 && mp->rtt.n == 0)
+			continue;
+		add_hist_row(str, mp->name, "wait", &mp->wait);
+		add_hist_row(str, mp->name, "rtt", &mp->rtt);
+		add_hist_row(str, mp->name, "handler", &mp->handler);
+	}
+	add_hist_row(str, "event", "parse", &metrics.parse);
+	add_hist_row(str, "event", "dispatch", &metrics.dispatch);
+	add_hist_row(str, "icontbl", "rebuild", &metrics.icontbl);
+	add_hist_row(str, "mainloop", "stall", &metrics.stall);
+	g_string_append(str, "events:");
+	for (i = 0; i < 128; i++) {
+		if (metrics.events[i] > 0)
+			g_string_append_printf(str, " %c=%lu", i,
+			    metrics.events[i]);
+	}
+	g_string_append_c(str, '\n');
+
+	return (str);
+}
+
+static gboolean
+dump_metrics(gpointer unused)
+{
+	GString *str;
+
+	str = metrics_report();
+	(void)fputs(str->str, stderr);
+	(void)g_string_free(str, TRUE);
+
+	return (TRUE);
+}
+
+static void
+write_metrics()
+{
+	FILE	*fp;
+	GString *str;
+
+	if (metrics.path == NULL)
+		return;
+	if ((fp = fopen(metrics.path, "w")) == NULL) {
+		warn("fopen(%s)", metrics.path);
+		return;
+	}
+	str = metrics_report();
+	(void)fputs(str->str, fp);
+	(void)g_string_free(str, TRUE);
+	(void)fclose(fp);
+}
+
+/*
+ * Returns true if the reply just read is the reply to the given command
+ * for the given device. If 'dev' is NULL, only the command name is
+ * compared. DSBMD doesn't send the device with every reply, so a reply
+ * without one never matches a device.
+ */
+static bool
+is_reply_to(const char *cmd, const char *dev)
+{
+	size_t len;
+
+	if (dsbmdevent.command == NULL)
+		return (false);
+	len = strcspn(cmd, " \n");
+	if (strlen(dsbmdevent.command) != len ||
+	    strncmp(cmd, dsbmdevent.command, len) != 0)
+		return (false);
+	if (dev == NULL)
+		return (true);
+	return (dsbmdevent.drvinfo.dev != NULL &&
+	    strcmp(dev, dsbmdevent.drvinfo.dev) == 0);
+}
+
+static void
+free_lostcmd(struct lostcmd_s *lp)
+{
+	g_free(lp->cmd);
+	g_free(lp->dev);
+	g_free(lp);
+}
+
+/*
+ * Returns the first lost command the reply just read matches, or NULL.
+ */
+static struct lostcmd_s *
+find_lostcmd(bool withdev)
+{
+	GList		 *l;
+	struct lostcmd_s *lp;
+
+	for (l = lostcmds->head; l != NULL; l = l->next) {
+		lp = l->data;
+		if (is_reply_to(lp->cmd, withdev ? lp->dev : NULL))
+			return (lp);
+	}
+	return (NULL);
+}
+
+/*
+ * Returns true if the reply just read belongs to a command we gave up
+ * waiting for. DSBMD replies in order, so the lost commands before the
+ * matching one were never answered, and once the sent command got its
+ * reply, none of the lost commands will be. A reply we can't match with
+ * certainty is left to the sent command. Only if no command is waiting
+ * for a reply, the command name alone is enough.
+ */
+static bool
+late_reply()
+{
+	command_t	 *cp = cmdsched.cur;
+	struct lostcmd_s *lp, *match;
+
+	if (g_queue_is_empty(lostcmds))
+		return (false);
+	if (cp != NULL && is_reply_to(cp->cmd, cp->icon->drvp->dev)) {
+		while ((lp = g_queue_pop_head(lostcmds)) != NULL)
+			free_lostcmd(lp);
+		return (false);
+	}
+	if ((match = find_lostcmd(true)) == NULL &&
+	    (cp != NULL || (match = find_lostcmd(false)) == NULL))
+		return (false);
+	while ((lp = g_queue_pop_head(lostcmds)) != match)
+		free_lostcmd(lp);
+	free_lostcmd(match);
+
+	return (true);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int			  ch, i, lockfd;
+	gint	      iotag;
+	char	      *p, *path, path_lock[PATH_MAX];
+	GIOChannel    *ioc;
+	struct passwd *pw;
+	struct option longopts[] = {
+		{ "profile-startup", optional_argument, NULL, 'P' },
+		{ "queue-stats",     no_argument,	NULL, 'Q' },
+		{ "metrics",	     required_argument, NULL, 'M' },
+		{ NULL,		     0,			NULL,  0  }
+	};
+
+	prof_mark(PROF_START);
+#ifdef WITH_GETTEXT
+	(void)setlocale(LC_ALL, "");
+	(void)bindtextdomain(PROGRAM, PATH_LOCALE);
+	(void)textdomain(PROGRAM);
+#endif
+	gtk_init(&argc, &argv);
+	prof_mark(PROF_GTK_INIT);
+	/* Show the recent protocol history on fatal errors. */
+	set_xerr_hook(print_flightrec);
+
+	mainwin.win_state = GDK_WINDOW_STATE_ABOVE;
+	while ((ch = getopt_long(argc, argv, "ih", longopts, NULL)) != -1) {
+		switch (ch) {
+		case 'i':
+			/* Start as tray icon. */
+			mainwin.win_state = GDK_WINDOW_STATE_WITHDRAWN;
+			break;
+		case 'P':
+			profile.enabled = true;
+			profile.json	= optarg;
+			break;
+		case 'Q':
+			cmdsched.stats = true;
+			break;
+		case 'M':
+			metrics.path = optarg;
+			break;
+		case '?':
+		case 'h':
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if ((pw = getpwuid(getuid())) == NULL)
+		xerr(NULL, EXIT_FAILURE, "getpwuid()");
+        /* Check if another instance is already running. */
+	(void)snprintf(path_lock, sizeof(path_lock), "%s/%s", pw->pw_dir,
+	    PATH_LOCK);
+	endpwent();
+	if ((lockfd = open(path_lock, O_WRONLY | O_CREAT, 0600)) == -1)
+		xerr(NULL, EXIT_FAILURE, "open(%s)", path_lock);
+	if (flock(lockfd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK) {
+			while (argc--)
+				(void)create_mddev(argv[argc]);
+			exit(EXIT_SUCCESS);
+		}
+		xerr(NULL, EXIT_FAILURE, "flock(%s)", path_lock);
+	}
+	while (argc--)
+		(void)create_mddev(argv[argc]);
+	if (sock != NULL)
+		(void)fclose(sock);
+	prof_mark(PROF_LOCK);
+
+	start_workers();
+	path = PATH_DSBMD_SOCKET;
+	for (i = 0; i < 10 && (sock = uconnect(path)) == NULL; i++) {
+		if (errno == EINTR || errno == ECONNREFUSED)
+			(void)sleep(1);
+		else
+			xerr(NULL, EXIT_FAILURE, "Couldn't connect to DSBMD");
+	}
+	if (i == 10)
+		xerr(NULL, EXIT_FAILURE, "Couldn't connect to DSBMD");
+	prof_mark(PROF_CONNECT);
+
+	/* Get the drive list from dsbmd. */
+	for (ndrives = 0, p = readln(true); p[0] != '='; p = readln(true)) {
+		if (parse_dsbmdevent(p) == -1)
+			continue;
+		if (dsbmdevent.type == EVENT_ADD_DEVICE) {
+			add_drive(&dsbmdevent.drvinfo);
+		} else if (dsbmdevent.type == EVENT_ERROR_MSG) {
+			if (dsbmdevent.code != ERR_PERMISSION_DENIED)
+				continue;
+			xerrx(NULL, EXIT_FAILURE,
+			    _("You are not allowed to connect to DSBMD"));
+		} else if (dsbmdevent.type == EVENT_SHUTDOWN) {
+			xerrx(NULL, EXIT_FAILURE, _("DSBMD just shut down."));
+		}
+	}
+	prof_mark(PROF_DRIVE_LIST);
+	ioc   = g_io_channel_unix_new(fileno(sock));
+	iotag = g_io_add_watch(ioc, G_IO_IN, readevent, NULL);
+
+	jobs	= g_hash_table_new(g_direct_hash, g_direct_equal);
+	jobhist = g_queue_new();
+	lostcmds = g_queue_new();
+	for (i = 0; i < NCMD_PRIOS; i++)
+		cmdsched.devs[i] = g_queue_new();
+
+	join_workers();
+	bind_cfg();
+	init_cfg_monitor();
+
+	settingsmenu.cmds[SETTINGS_FM].var	 = CFG_FILEMANAGER;
+	settingsmenu.cmds[SETTINGS_DVD].var	 = CFG_PLAY_DVD;
+	settingsmenu.cmds[SETTINGS_DVD].autovar	 = CFG_DVD_AUTO;
+	settingsmenu.cmds[SETTINGS_VCD].var	 = CFG_PLAY_VCD;
+	settingsmenu.cmds[SETTINGS_VCD].autovar	 = CFG_VCD_AUTO;
+	settingsmenu.cmds[SETTINGS_SVCD].var	 = CFG_PLAY_SVCD;
+	settingsmenu.cmds[SETTINGS_SVCD].autovar = CFG_SVCD_AUTO;
+	settingsmenu.cmds[SETTINGS_CDDA].var	 = CFG_PLAY_CDDA;
+	settingsmenu.cmds[SETTINGS_CDDA].autovar = CFG_CDDA_AUTO;
+	compile_cmdtmpls(NULL);
+	compile_sect_cmdtmpls();
+	sync_changed(NULL);
+	watchdog_changed(NULL);
+
+	(void)g_unix_signal_add(SIGTERM, quit, NULL);
+	(void)g_unix_signal_add(SIGINT, quit, NULL);
+	(void)g_unix_signal_add(SIGHUP, quit, NULL);
+	(void)signal(SIGQUIT, sigquit);
+	(void)g_unix_signal_add(SIGUSR1, dump_metrics, NULL);
+	(void)g_unix_signal_add(SIGUSR2, dump_flightrec, NULL);
+
+	create_icon_list();
+	mainwin.store = create_icontbl(NULL);
+	create_tray_icon();
+	if (mainwin.win_state != GDK_WINDOW_STATE_WITHDRAWN)
+		show_mainwin();
+	if (profile.enabled) {
+		/*
+		 * Mark the first icon once the main loop is idle, that is,
+		 * after the initial redraw.
+		 */
+		(void)g_idle_add_full(G_PRIORITY_LOW, prof_first_icon, NULL,
+		    NULL);
+	}
+	gtk_main();
+	cleanup();
+
+	return (EXIT_SUCCESS);
+}
+
+static void
+usage()
+{
+	(void)printf("Usage: %s [-ih] [--profile-startup[=<file>]] " \
+		     "[--queue-stats] [--metrics=<file>]\n" \
+		     "       [<disk image> ...]\n" \
+		     "   -i: Start %s as tray icon\n" \
+		     "   --profile-startup: Print the time spent in each " \
+		     "startup phase,\n" \
+		     "                      and optionally write it as " \
+		     "JSON to <file>\n" \
+		     "   --queue-stats: Print how long DSBMD commands " \
+		     "waited in the queue\n" \
+		     "                  on exit\n" \
+		     "   --metrics: Write the latency metrics to <file> " \
+		     "on exit\n", PROGRAM, PROGRAM);
+	exit(EXIT_FAILURE);
+}
+
+static void
+prof_mark(int phase)
+{
+	struct rusage ru;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &profile.phase[phase].ts);
+	if (getrusage(RUSAGE_SELF, &ru) == 0)
+		profile.phase[phase].maxrss = ru.ru_maxrss;
+	profile.phase[phase].done = true;
+}
+
+static gboolean
+prof_first_icon(gpointer unused)
+{
+	prof_mark(PROF_FIRST_ICON);
+	prof_report();
+
+	return (FALSE);
+}
+
+/*
+ * Prints the time spent in each startup phase to stderr, and writes it
+ * to the JSON file if requested.
+ */
+static void
+prof_report()
+{
+	int    i, j, n, prev, order[NPROF_PHASES];
+	FILE   *fp;
+	double delta[NPROF_PHASES], total[NPROF_PHASES];
+
+#define TS_MS(a, b) \
+	(((a).tv_sec - (b).tv_sec) * 1000.0 + \
+	 ((a).tv_nsec - (b).tv_nsec) / 1000000.0)
+	/*
+	 * Some phases end on the startup threads, so sort the phases by
+	 * the time they ended.
+	 */
+	for (i = 1, n = 0; i < NPROF_PHASES; i++) {
+		if (!profile.phase[i].done)
+			continue;
+		total[i] = TS_MS(profile.phase[i].ts,
+		    profile.phase[PROF_START].ts);
+		for (j = n++; j > 0 && total[order[j - 1]] > total[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (j = 0, prev = PROF_START; j < n; prev = order[j++]) {
+		delta[order[j]] = TS_MS(profile.phase[order[j]].ts,
+		    profile.phase[prev].ts);
+	}
+#undef TS_MS
+	(void)fprintf(stderr, "%-12s %10s %10s %12s\n", "phase", "delta(ms)",
+	    "total(ms)", "maxrss(KB)");
+	for (j = 0; j < n; j++) {
+		i = order[j];
+		(void)fprintf(stderr, "%-12s %10.3f %10.3f %12ld\n",
+		    profile.phase[i].name, delta[i], total[i],
+		    profile.phase[i].maxrss);
+	}
+	(void)fprintf(stderr, "time-to-first-icon: %.3f ms\n",
+	    total[PROF_FIRST_ICON]);
+	if (profile.json == NULL)
+		return;
+	if ((fp = fopen(profile.json, "w")) == NULL) {
+		warn("fopen(%s)", profile.json);
+		return;
+	}
+	(void)fprintf(fp, "{\n  \"phases\": [\n");
+	for (j = 0; j < n; j++) {
+		i = order[j];
+		(void)fprintf(fp, "%s    { \"name\": \"%s\", " \
+		    "\"delta_ms\": %.3f, \"total_ms\": %.3f, " \
+		    "\"maxrss_kb\": %ld }", j > 0 ? ",\n" : "",
+		    profile.phase[i].name, delta[i], total[i],
+		    profile.phase[i].maxrss);
+	}
+	(void)fprintf(fp, "\n  ],\n  \"time_to_first_icon_ms\": %.3f\n}\n",
+	    total[PROF_FIRST_ICON]);
+	if (fclose(fp) != 0)
+		warn("fclose(%s)", profile.json);
+}
+
+/*
+ * Creates the tray icon and the menu shared by the tray icon and the main
+ * window's menu bar.
+ */
+static void
+create_tray_icon()
+{
+	GtkWidget *item, *image;
+
+	mainwin.menu = gtk_menu_new();
+	image = gtk_image_new_from_icon_name("preferences-system", GTK_ICON_SIZE_MENU);
+	item  = gtk_image_menu_item_new_with_mnemonic(_("_Preferences"));
+	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), image);
+	gtk_menu_shell_append(GTK_MENU_SHELL(mainwin.menu), item);
+	g_signal_connect(G_OBJECT(item), "activate",
 	    G_CALLBACK(settings_menu), NULL);
 
+	image = gtk_image_new_from_icon_name("system-run", GTK_ICON_SIZE_MENU);
+	item  = gtk_image_menu_item_new_with_mnemonic(_("_Jobs"));
+	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), image);
+	gtk_menu_shell_append(GTK_MENU_SHELL(mainwin.menu), item);
+	g_signal_connect(G_OBJECT(item), "activate",
+	    G_CALLBACK(jobs_window), NULL);
+
+	image = gtk_image_new_from_icon_name("utilities-system-monitor",
+	    GTK_ICON_SIZE_MENU);
+	item  = gtk_image_menu_item_new_with_mnemonic(_("_Diagnostics"));
+	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), image);
+	gtk_menu_shell_append(GTK_MENU_SHELL(mainwin.menu), item);
+	g_signal_connect(G_OBJECT(item), "activate",
+	    G_CALLBACK(diag_window), NULL);
+
 	image = gtk_image_new_from_icon_name("application-exit", GTK_ICON_SIZE_MENU);
 	item  = gtk_image_menu_item_new_with_mnemonic(_("_Quit"));
 	gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item), image);
-	gtk_menu_shell_append(GTK_MENU_SHELL(menu), item);
-	g_signal_connect(G_OBJECT(item), "activate",
-	    G_CALLBACK(cleanup), NULL);
+	gtk_menu_shell_append(GTK_MENU_SHELL(mainwin.menu), item);
+	g_signal_connect_swapped(G_OBJECT(item), "activate",
+	    G_CALLBACK(quit), NULL);
+	gtk_widget_show_all(mainwin.menu);
+
+	mainwin.tray_icon = gtk_status_icon_new_from_pixbuf(
+	    lookup_pixbuf("dsbmc"));
+ 	g_signal_connect(G_OBJECT(mainwin.tray_icon), "activate",
+	    G_CALLBACK(tray_click), NULL);
+	g_signal_connect(G_OBJECT(mainwin.tray_icon), "popup-menu",
+	    G_CALLBACK(popup_tray_ctxmenu), G_OBJECT(mainwin.menu));
+	gtk_status_icon_set_tooltip_text(mainwin.tray_icon, "DSBMC");
+	gtk_status_icon_set_visible(mainwin.tray_icon, TRUE);
+}
+
+/*
+ * Creates the main window. In tray mode, this is deferred until the
+ * window is needed for the first time.
+ */
+static void
+create_mainwin()
+{
+	int		i;
+	GtkWidget	*root_menu, *menu_bar, *sw, *vbox;
+#if GTK_CHECK_VERSION(3, 10, 0)
+	GtkCellRenderer *renderer;
+#endif
+
+	if (mainwin.win != NULL)
+		return;
+	render_icons();
+	for (i = 0; i < nicons; i++)
+		set_icon_pixbufs(icons[i]);
+	(void)create_icontbl(mainwin.store);
+
+	mainwin.win = GTK_WINDOW(gtk_window_new(GTK_WINDOW_TOPLEVEL));
+	gtk_window_set_default_size(mainwin.win, *mainwin.width,
+	    *mainwin.height);
+	gtk_window_set_title(mainwin.win, TITLE);
+	gtk_window_set_resizable(mainwin.win, TRUE);
+	gtk_window_set_icon(mainwin.win, lookup_pixbuf("dsbmc"));
+
 	root_menu = gtk_menu_item_new_with_mnemonic(_("_File"));
-	gtk_menu_item_set_submenu(GTK_MENU_ITEM(root_menu), menu);
+	gtk_menu_item_set_submenu(GTK_MENU_ITEM(root_menu), mainwin.menu);
 
 	menu_bar = gtk_menu_bar_new();
 	gtk_menu_shell_append(GTK_MENU_SHELL(menu_bar), root_menu);
 	gtk_widget_show(menu_bar);
 
-	mainwin.store = gtk_list_store_new(NUM_COLS, G_TYPE_STRING,
-		    GDK_TYPE_PIXBUF, G_TYPE_POINTER, G_TYPE_STRING);
-
 	mainwin.icon_view = 
 	    gtk_icon_view_new_with_model(GTK_TREE_MODEL(mainwin.store));
 	gtk_icon_view_set_text_column(GTK_ICON_VIEW(mainwin.icon_view),
 	    COL_NAME);
+#if GTK_CHECK_VERSION(3, 10, 0)
+	renderer = gtk_cell_renderer_pixbuf_new();
+	gtk_cell_layout_pack_start(GTK_CELL_LAYOUT(mainwin.icon_view),
+	    renderer, FALSE);
+	gtk_cell_layout_set_attributes(GTK_CELL_LAYOUT(mainwin.icon_view),
+	    renderer, "surface", COL_SURFACE, NULL);
+	g_signal_connect(G_OBJECT(mainwin.win), "notify::scale-factor",
+	    G_CALLBACK(scale_changed), NULL);
+#else
 	gtk_icon_view_set_pixbuf_column(GTK_ICON_VIEW(mainwin.icon_view),
 	    COL_PIXBUF);
-	mainwin.store = create_icontbl(mainwin.store);
+#endif
 
 	sw = gtk_scrolled_window_new(NULL, NULL);
 	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
@@ -790,16 +2053,8 @@ create_mainwin()
 	gtk_box_pack_start(GTK_BOX(vbox), mainwin.statusbar, FALSE, FALSE, 0);
 	gtk_container_add(GTK_CONTAINER(mainwin.win), vbox);
 
-	mainwin.tray_icon = gtk_status_icon_new_from_pixbuf(icon);
 	g_signal_connect(G_OBJECT(mainwin.icon_view),
                     "button-press-event", G_CALLBACK(icon_clicked), NULL);
- 	g_signal_connect(G_OBJECT(mainwin.tray_icon), "activate",
-	    G_CALLBACK(tray_click), mainwin.win);
-	g_signal_connect(G_OBJECT(mainwin.tray_icon), "popup-menu",
-	    G_CALLBACK(popup_tray_ctxmenu), G_OBJECT(menu));
-	gtk_status_icon_set_tooltip_text(mainwin.tray_icon, "DSBMC");
-	gtk_status_icon_set_visible(mainwin.tray_icon, TRUE);
-
 	g_signal_connect(mainwin.win, "delete-event",
 	    G_CALLBACK(hide_win), NULL);
 	g_signal_connect(G_OBJECT(mainwin.win), "window-state-event",
@@ -809,45 +2064,399 @@ create_mainwin()
 	if (*mainwin.posx >= 0 && *mainwin.posy >= 0)
 		gtk_window_move(GTK_WINDOW(mainwin.win),
 		    *mainwin.posx, *mainwin.posy);
-	if (mainwin.win_state != GDK_WINDOW_STATE_WITHDRAWN)  
-		gtk_widget_show_all(GTK_WIDGET(mainwin.win));
+	prof_mark(PROF_MAINWIN);
+}
+
+/*
+ * Creates the main window if necessary, and shows it.
+ */
+static void
+show_mainwin()
+{
+	create_mainwin();
+	gtk_window_deiconify(GTK_WINDOW(mainwin.win));
+	gtk_widget_show_all(GTK_WIDGET(mainwin.win));
 }
 
 static void
 hide_win(GtkWidget *win)
-{       
-	gtk_window_get_position(GTK_WINDOW(win), mainwin.posx, mainwin.posy);
-	if (*mainwin.posx < 0 || *mainwin.posy < 0  ||
-	    gdk_screen_width() - *mainwin.posx < 0 ||
-	    gdk_screen_height() - *mainwin.posy < 0)
-		*mainwin.posx = *mainwin.posy = 0;
-	gtk_window_get_size(GTK_WINDOW(win), mainwin.width, mainwin.height);
+{
+	int x, y, width, height;
+
+	if (win == NULL)
+		return;
+	gtk_window_get_position(GTK_WINDOW(win), &x, &y);
+	gtk_window_get_size(GTK_WINDOW(win), &width, &height);
+	save_win_geometry(x, y, width, height);
 	gtk_widget_hide(win);
 }
 
+/*
+ * Stores the window's position and size in the config, and schedules
+ * writing the config file. Positions off screen are reset to 0.
+ */
+static void
+save_win_geometry(int x, int y, int width, int height)
+{
+	if (x < 0 || y < 0 || gdk_screen_width() - x < 0 ||
+	    gdk_screen_height() - y < 0)
+		x = y = 0;
+	(void)dsbcfg_setval(cfg, CFG_POS_X, DSBCFG_VAL(x));
+	(void)dsbcfg_setval(cfg, CFG_POS_Y, DSBCFG_VAL(y));
+	if (width > 0 && height > 0) {
+		(void)dsbcfg_setval(cfg, CFG_WIDTH, DSBCFG_VAL(width));
+		(void)dsbcfg_setval(cfg, CFG_HEIGHT, DSBCFG_VAL(height));
+	}
+	schedule_cfg_flush();
+}
+
+/*
+ * (Re)starts the timer to write the config file. Window moves and
+ * resizes produce many events, so the file is only written once the
+ * changes settled, and the main loop is idle.
+ */
+static void
+schedule_cfg_flush()
+{
+	if (!dsbcfg_isdirty(cfg))
+		return;
+	if (cfgflush.timer > 0)
+		(void)g_source_remove(cfgflush.timer);
+	cfgflush.timer = g_timeout_add(CFG_FLUSH_DELAY, cfg_flush_timeout,
+	    NULL);
+}
+
+static gboolean
+cfg_flush_timeout(gpointer unused)
+{
+	cfgflush.timer = 0;
+	if (cfgflush.idle == 0) {
+		cfgflush.idle = g_idle_add_full(G_PRIORITY_LOW, cfg_flush_idle,
+		    NULL, NULL);
+	}
+	return (FALSE);
+}
+
+static gboolean
+cfg_flush_idle(gpointer unused)
+{
+	cfgflush.idle = 0;
+	flush_cfg();
+
+	return (FALSE);
+}
+
+/*
+ * Points the window geometry and the settings menu to the current config.
+ */
+static void
+bind_cfg()
+{
+	mainwin.posx   = &dsbcfg_getval(cfg, CFG_POS_X).integer;
+	mainwin.posy   = &dsbcfg_getval(cfg, CFG_POS_Y).integer;
+	mainwin.width  = &dsbcfg_getval(cfg, CFG_WIDTH).integer;
+	mainwin.height = &dsbcfg_getval(cfg, CFG_HEIGHT).integer;
+	settingsmenu.ignore_list = &dsbcfg_getval(cfg, CFG_HIDE).strings;
+}
+
+/*
+ * Writes the config file if it changed. Changes another program made to
+ * the file in the meantime are merged first. If the file can't be read,
+ * it is not overwritten, so a broken hand edit is not lost.
+ */
+static void
+flush_cfg()
+{
+	const char *sect;
+
+	if (!dsbcfg_isdirty(cfg))
+		return;
+	if (cfg_changed_on_disk() && reload_cfg() == -1)
+		return;
+	sect = wd_enter("config write");
+	if (dsbcfg_flush(PROGRAM, PATH_CONFIG, cfg) == -1)
+		warnx("%s", dsbcfg_strerror());
+	stat_cfg();
+	wd_leave(sect);
+}
+
+static void
+init_cfg_monitor()
+{
+	GFile *file;
+
+	cfgmon.path = g_build_filename(g_get_home_dir(), PATH_DSB_CFG_DIR,
+	    PROGRAM, PATH_CONFIG, NULL);
+	stat_cfg();
+	file = g_file_new_for_path(cfgmon.path);
+	cfgmon.monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+	    NULL, NULL);
+	g_object_unref(file);
+	if (cfgmon.monitor != NULL) {
+		g_signal_connect(G_OBJECT(cfgmon.monitor), "changed",
+		    G_CALLBACK(cfg_file_changed), NULL);
+	}
+}
+
+static void
+stat_cfg()
+{
+	if (stat(cfgmon.path, &cfgmon.sb) == -1)
+		(void)memset(&cfgmon.sb, 0, sizeof(cfgmon.sb));
+}
+
+/*
+ * Returns true if the config file was changed since we read or wrote it
+ * the last time.
+ */
+static bool
+cfg_changed_on_disk()
+{
+	struct stat sb;
+
+	if (stat(cfgmon.path, &sb) == -1)
+		return (false);
+	return (sb.st_ino != cfgmon.sb.st_ino ||
+	    sb.st_size != cfgmon.sb.st_size ||
+	    sb.st_mtime != cfgmon.sb.st_mtime);
+}
+
+static void
+cfg_file_changed(GFileMonitor *monitor, GFile *file, GFile *other,
+	GFileMonitorEvent event, gpointer unused)
+{
+	if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+	    event != G_FILE_MONITOR_EVENT_CREATED)
+		return;
+	/* Editors produce several events per save. */
+	if (cfgmon.timer > 0)
+		(void)g_source_remove(cfgmon.timer);
+	cfgmon.timer = g_timeout_add(CFG_RELOAD_DELAY, cfg_reload_timeout,
+	    NULL);
+}
+
+static gboolean
+cfg_reload_timeout(gpointer unused)
+{
+	cfgmon.timer = 0;
+	/* Ignore the events caused by our own writes. */
+	if (cfg_changed_on_disk())
+		(void)reload_cfg();
+	return (FALSE);
+}
+
+/*
+ * Rereads the config file, and applies the variables that changed. Local
+ * changes not yet written are merged into the new config, so they win over
+ * the file, and are written back with the next flush.
+ *
+ * Returns -1 if the file couldn't be read or merged. The file then still
+ * counts as changed on disk, and is read again on the next attempt.
+ */
+static int
+reload_cfg()
+{
+	int	   i;
+	bool	   changed[CFG_NVARS], sections;
+	dsbcfg_t   *old, *new;
+	const char *sect;
+
+	sect = wd_enter("config read");
+	new = dsbcfg_read(PROGRAM, PATH_CONFIG, vardefs, CFG_NVARS);
+	wd_leave(sect);
+	if (new == NULL) {
+		xwarnx(mainwin.win, "%s", dsbcfg_strerror());
+		return (-1);
+	}
+	if (dsbcfg_isdirty(cfg) &&
+	    dsbcfg_merge(new, cfg, vardefs, CFG_NVARS) == -1) {
+		xwarnx(mainwin.win, "%s", dsbcfg_strerror());
+		dsbcfg_free(new);
+		return (-1);
+	}
+	stat_cfg();
+	for (i = 0; i < CFG_NVARS; i++)
+		changed[i] = !dsbcfg_varequal(cfg, new, i);
+	sections = !devsections_equal(cfg, new);
+
+	old = cfg; cfg = new;
+	bind_cfg();
+	if (sections)
+		compile_sect_cmdtmpls();
+	notify_cfg_changed(changed);
+	dsbcfg_free(old);
+	schedule_cfg_flush();
+
+	return (0);
+}
+
+/*
+ * Returns true if both configs have the same device sections with the
+ * same settings.
+ */
+static bool
+devsections_equal(dsbcfg_t *a, dsbcfg_t *b)
+{
+	int	 i, n;
+	dsbcfg_t *cp, *np;
+
+	for (n = 0, cp = a; cp != NULL; cp = cp->next) {
+		if (cp->label == NULL)
+			continue;
+		if ((np = dsbcfg_getnode(b, cp->label)) == NULL)
+			return (false);
+		for (i = 0; i < CFG_NVARS; i++) {
+			if (!dsbcfg_varequal(cp, np, i))
+				return (false);
+		}
+		n++;
+	}
+	for (cp = b; cp != NULL; cp = cp->next) {
+		if (cp->label != NULL)
+			n--;
+	}
+	return (n == 0);
+}
+
+/*
+ * Calls the functions subscribed to the changed variables.
+ */
+static void
+notify_cfg_changed(const bool *changed)
+{
+	int i, j;
+
+	for (i = 0; i < CFG_NVARS; i++) {
+		if (!changed[i] || cfgsubs[i] == NULL)
+			continue;
+		/* Call each function only once. */
+		for (j = 0; j < i; j++) {
+			if (changed[j] && cfgsubs[j] == cfgsubs[i])
+				break;
+		}
+		if (j == i)
+			cfgsubs[i](changed);
+	}
+}
+
+static void
+cmdtmpls_changed(const bool *changed)
+{
+	compile_cmdtmpls(changed);
+}
+
+static void
+autoplay_changed(const bool *changed)
+{
+	/* Resolve the drive settings again. */
+	cfggen++;
+}
+
+static void
+geometry_changed(const bool *changed)
+{
+	if (mainwin.win == NULL)
+		return;
+	if (changed[CFG_WIDTH] || changed[CFG_HEIGHT])
+		gtk_window_resize(mainwin.win, *mainwin.width, *mainwin.height);
+	if ((changed[CFG_POS_X] || changed[CFG_POS_Y]) &&
+	    *mainwin.posx >= 0 && *mainwin.posy >= 0)
+		gtk_window_move(mainwin.win, *mainwin.posx, *mainwin.posy);
+}
+
+/*
+ * Shows the drives removed from the ignore list, and hides the ones added.
+ */
+static void
+ignore_list_changed(const bool *changed)
+{
+	int  i;
+	bool hidden, update;
+
+	for (i = 0, update = false; i < ndrives; i++) {
+		if ((hidden = drive_hidden(drives[i])) == drives[i]->hidden)
+			continue;
+		drives[i]->hidden = hidden;
+		if (hidden)
+			del_icon(drives[i]->dev);
+		else
+			(void)add_icon(drives[i]);
+		update = true;
+	}
+	if (update && mainwin.store != NULL)
+		(void)create_icontbl(mainwin.store);
+}
+
+/*
+ * Sets how the config file is written.
+ */
+static void
+sync_changed(const bool *changed)
+{
+	int	   i;
+	const char *mode;
+	static const struct syncmode_s {
+		const char *name;
+		int	   mode;
+	} modes[] = {
+		{ "none", DSBCFG_SYNC_NONE },
+		{ "file", DSBCFG_SYNC_FILE },
+		{ "dir",  DSBCFG_SYNC_DIR  }
+	};
+
+	if ((mode = dsbcfg_getval(cfg, CFG_SYNC).string) == NULL)
+		mode = "file";
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		if (strcmp(mode, modes[i].name) == 0) {
+			dsbcfg_setsync(modes[i].mode);
+			return;
+		}
+	}
+	xwarnx(NULL, "%s: Invalid value \"%s\"",
+	    dsbcfg_varname(cfg, CFG_SYNC), mode);
+	dsbcfg_setsync(DSBCFG_SYNC_FILE);
+}
+
+/*
+ * Returns true if both string lists have the same elements.
+ */
+static bool
+strings_equal(char **a, char **b)
+{
+	for (; a != NULL && b != NULL && *a != NULL && *b != NULL; a++, b++) {
+		if (strcmp(*a, *b) != 0)
+			return (false);
+	}
+	return ((a == NULL || *a == NULL) && (b == NULL || *b == NULL));
+}
+
 static gboolean
 window_state_event(GtkWidget *wdg, GdkEvent *event, gpointer unused)
 {       
 	switch ((int)event->type) {
 	case GDK_CONFIGURE:
-		*mainwin.posx   = ((GdkEventConfigure *)event)->x;
-		*mainwin.posy   = ((GdkEventConfigure *)event)->y;
-		*mainwin.width  = ((GdkEventConfigure *)event)->width;
-		*mainwin.height = ((GdkEventConfigure *)event)->height;
-		dsbcfg_write(PROGRAM, PATH_CONFIG, cfg);
+		save_win_geometry(((GdkEventConfigure *)event)->x,
+		    ((GdkEventConfigure *)event)->y,
+		    ((GdkEventConfigure *)event)->width,
+		    ((GdkEventConfigure *)event)->height);
 		break;
 	case GDK_WINDOW_STATE:
 		mainwin.win_state =
 		    ((GdkEventWindowState *)event)->new_window_state;
-		dsbcfg_write(PROGRAM, PATH_CONFIG, cfg);
 		break;
 	}
 	return (FALSE);
 }
 
 static void
-tray_click(GtkStatusIcon *status_icon, gpointer win)
+tray_click(GtkStatusIcon *status_icon, gpointer unused)
 {
+	int	  x, y;
+	GtkWindow *win;
+
+	if (mainwin.win == NULL)
+		create_mainwin();
+	win = mainwin.win;
 	if ((mainwin.win_state & GDK_WINDOW_STATE_ICONIFIED) ||
 	    (mainwin.win_state & GDK_WINDOW_STATE_WITHDRAWN) ||
 	    (mainwin.win_state & GDK_WINDOW_STATE_BELOW)) {
@@ -859,12 +2468,8 @@ tray_click(GtkStatusIcon *status_icon, gpointer win)
 		}
 		gtk_widget_show_all(GTK_WIDGET(win));
 	} else {
-		gtk_window_get_position(GTK_WINDOW(win),
-		    mainwin.posx, mainwin.posy);
-		if (*mainwin.posx < 0   || *mainwin.posy < 0 ||
-		    gdk_screen_width()  - *mainwin.posx < 0 ||
-		    gdk_screen_height() - *mainwin.posy < 0)
-			*mainwin.posx = *mainwin.posy = 0;
+		gtk_window_get_position(GTK_WINDOW(win), &x, &y);
+		save_win_geometry(x, y, 0, 0);
 		gtk_widget_hide(GTK_WIDGET(win));
 	}
 }
@@ -878,12 +2483,12 @@ popup_tray_ctxmenu(GtkStatusIcon *icon, guint bt, guint tm, gpointer menu)
 static void
 settings_menu()
 {
-	int	     i, j;
-	char	     *s, *q, *qs, **v;
-	bool	     error;
+	int	     i, j, response;
+	char	     *s, *qs, **v;
+	bool	     error, changed[CFG_NVARS];
 	size_t	     len;
-	drive_t	     *dp;
-	const char   *p;
+	cmdtmpl_t    *tmpl;
+	const char   *p, *errmsg, *sect;
 	GtkWidget    *win, *abt, *cbt, *cb, *label, *table, *image;
 	GtkWidget    *entry[SETTINGS_NCMDS + 1];
 
@@ -900,8 +2505,7 @@ settings_menu()
 		for (j = 0; j < PIXBUFTBLSZ; j++) {
 			if (strcmp(settingsmenu.cmds[i].iconid,
 			    pixbuftbl[j].id) == 0) {
-				image = gtk_image_new_from_pixbuf(
-				    pixbuftbl[j].icon);
+				image = new_icon_image(pixbuftbl[j].icon);
 				break;
 			}
 		}
@@ -909,16 +2513,17 @@ settings_menu()
 		    _(settingsmenu.cmds[i].action));
 		entry[i] = gtk_entry_new();
 		gtk_entry_set_text(GTK_ENTRY(entry[i]),
-		    *settingsmenu.cmds[i].cmdstr);
+		    dsbcfg_getval(cfg, settingsmenu.cmds[i].var).string);
 		gtk_entry_set_width_chars(GTK_ENTRY(entry[i]), 35);
-		if (settingsmenu.cmds[i].autoplay != NULL) {
+		if (settingsmenu.cmds[i].autovar != -1) {
 			cb = gtk_check_button_new_with_label("Autoplay");
 			gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(cb),
-			    *settingsmenu.cmds[i].autoplay);
+			    dsbcfg_getval(cfg,
+			    settingsmenu.cmds[i].autovar).boolean);
 			gtk_table_attach(GTK_TABLE(table), cb, 3, 4, i, i + 1,
 			    GTK_EXPAND |GTK_FILL, 0, 0, 0);
 			g_signal_connect(cb, "toggled", G_CALLBACK(cb_cb),
-			    settingsmenu.cmds[i].autoplay);
+			    GINT_TO_POINTER(settingsmenu.cmds[i].autovar));
 		}
 		gtk_table_attach(GTK_TABLE(table), image, 0, 1, i, i + 1,
 		    GTK_FILL, 0, 0, 0);
@@ -933,7 +2538,7 @@ settings_menu()
 	}
 	for (j = 0; j < PIXBUFTBLSZ; j++) {
 		if (strcmp("hide", pixbuftbl[j].id) == 0) {
-			image = gtk_image_new_from_pixbuf(pixbuftbl[j].icon);
+			image = new_icon_image(pixbuftbl[j].icon);
 			break;
 		}
 	}
@@ -988,19 +2593,23 @@ settings_menu()
 	for (i = 0; i < SETTINGS_NCMDS + 1; i++)
 		gtk_editable_select_region(GTK_EDITABLE(entry[i]), 0, 0);
 	for (;;) {
-		if (gtk_dialog_run(GTK_DIALOG(win)) != GTK_RESPONSE_ACCEPT)
+		sect = wd_enter("settings dialog");
+		response = gtk_dialog_run(GTK_DIALOG(win));
+		wd_leave(sect);
+		if (response != GTK_RESPONSE_ACCEPT)
 			break;
+		/* Reject invalid command templates. */
 		for (i = 0; i < SETTINGS_NCMDS; i++) {
 			p = gtk_entry_get_text(GTK_ENTRY(entry[i]));
-			q = *settingsmenu.cmds[i].cmdstr;
-			if (strcmp(p, q) == 0)
-				continue;
-			free(q);
-			q = *settingsmenu.cmds[i].cmdstr = g_strdup(p);
-			if (q == NULL) {
-				xerr(GTK_WINDOW(win), EXIT_FAILURE,
-				    "g_strdup()");
-			}
+			if ((tmpl = compile_cmdtmpl(p, &errmsg)) == NULL)
+				break;
+			free_cmdtmpl(tmpl);
+		}
+		if (i < SETTINGS_NCMDS) {
+			xwarnx(GTK_WINDOW(win), "%s%s",
+			    _(settingsmenu.cmds[i].action), errmsg);
+			gtk_widget_grab_focus(entry[i]);
+			continue;
 		}
 		p = gtk_entry_get_text(GTK_ENTRY(entry[SETTINGS_NCMDS]));
 		v = dsbcfg_list_to_strings(p, &error);
@@ -1008,22 +2617,25 @@ settings_menu()
 			xwarnx(GTK_WINDOW(win), "%s", dsbcfg_strerror());
 			continue;
 		}
-		dsbcfg_setval(cfg, CFG_HIDE, DSBCFG_VAL(v));
-		create_icon_list();
-		dsbcfg_write(PROGRAM, PATH_CONFIG, cfg);
-		for (v = dsbcfg_getval(cfg, CFG_HIDE).strings;
-		    v != NULL && *v != NULL; v++) {
-			dp = lookupdrv_from_mnt(*v);
-			if (dp != NULL) {
-				del_icon(dp->dev);
-				(void)create_icontbl(mainwin.store);
-			} else if ((dp = lookupdrv(*v)) != NULL) {
-				del_icon(dp->dev);
-                                (void)create_icontbl(mainwin.store);
+		(void)memset(changed, 0, sizeof(changed));
+		for (i = 0; i < SETTINGS_NCMDS; i++) {
+			j = settingsmenu.cmds[i].var;
+			p = gtk_entry_get_text(GTK_ENTRY(entry[i]));
+			s = dsbcfg_getval(cfg, j).string;
+			changed[j] = s == NULL || strcmp(s, p) != 0;
+			if (dsbcfg_setval(cfg, j, DSBCFG_VAL((char *)p)) == -1) {
+				xerrx(GTK_WINDOW(win), EXIT_FAILURE, "%s",
+				    dsbcfg_strerror());
 			}
 		}
-		(void)create_icontbl(mainwin.store);
-		if ((mainwin.win_state & GDK_WINDOW_STATE_ICONIFIED) ||
+		changed[CFG_HIDE] = !strings_equal(v,
+		    dsbcfg_getval(cfg, CFG_HIDE).strings);
+		dsbcfg_setval(cfg, CFG_HIDE, DSBCFG_VAL(v));
+		notify_cfg_changed(changed);
+		flush_cfg();
+		if (!changed[CFG_HIDE] || mainwin.win == NULL)
+			;
+		else if ((mainwin.win_state & GDK_WINDOW_STATE_ICONIFIED) ||
 		    (mainwin.win_state & GDK_WINDOW_STATE_WITHDRAWN)) {
 			gtk_widget_show_all(GTK_WIDGET(mainwin.win));
 			gtk_widget_hide(GTK_WIDGET(mainwin.win));
@@ -1035,13 +2647,40 @@ settings_menu()
 	gtk_widget_destroy(win);
 }
 
+/*
+ * Called on SIGTERM, SIGINT, SIGHUP, SIGQUIT, or from the menu. The signals
+ * are delivered through the main loop, so the cleanup can safely run after
+ * gtk_main() returned.
+ */
+static gboolean
+quit(gpointer unused)
+{
+	gtk_main_quit();
+
+	return (TRUE);
+}
+
+/*
+ * GLib doesn't deliver SIGQUIT through the main loop. Pass it on as SIGTERM,
+ * which is async-signal-safe.
+ */
 static void
-cleanup(int unused)
+sigquit(int unused)
 {
+	(void)raise(SIGTERM);
+}
 
-	dsbcfg_write(PROGRAM, PATH_CONFIG, cfg);
-	gtk_main_quit();
-	exit(0);
+/*
+ * Writes back pending changes, and the statistics before we exit.
+ */
+static void
+cleanup()
+{
+	flush_bookmarks();
+	flush_cfg();
+	if (cmdsched.stats)
+		print_queue_stats();
+	write_metrics();
 }
 
 static ctxmenu_t *
@@ -1066,7 +2705,7 @@ create_ctxmenu(icon_t *icon)
 			continue;
 		item  = gtk_image_menu_item_new_with_mnemonic(
 		    _(menucmds[i].name));
-		image = gtk_image_new_from_pixbuf(cmdtbl[j].pix);
+		image = new_icon_image(cmdtbl[j].pix);
 		gtk_image_menu_item_set_image(GTK_IMAGE_MENU_ITEM(item),
 		   image);
 		gtk_menu_shell_append(GTK_MENU_SHELL(ctxmenu->menu), item);
@@ -1083,6 +2722,16 @@ create_ctxmenu(icon_t *icon)
 		free(ctxmenu);
 		return (NULL);
 	}
+	item = gtk_separator_menu_item_new();
+	gtk_menu_shell_append(GTK_MENU_SHELL(ctxmenu->menu), item);
+	gtk_widget_show(item);
+	item = gtk_menu_item_new_with_mnemonic(_("_Cancel pending commands"));
+	gtk_menu_shell_append(GTK_MENU_SHELL(ctxmenu->menu), item);
+	g_signal_connect(G_OBJECT(item), "activate", G_CALLBACK(cb_cancel),
+	    icon);
+	ctxmenu->menuitems[MENU_ITEM_CANCEL] = item;
+	gtk_widget_show(item);
+
 	return (ctxmenu);
 }
 
@@ -1115,32 +2764,76 @@ add_icon(drive_t *drvp)
 		icons[k] = icons[k - 1];
 	if ((icons[j] = malloc(sizeof(icon_t))) == NULL)
 		return (NULL);
-	icons[j]->drvp	      = drvp;
-	icons[j]->ctxmenu     = create_ctxmenu(icons[j]);
-	icons[j]->pix_normal  = disktypetbl[i].pix_normal;
-	icons[j]->pix_mounted = disktypetbl[i].pix_mounted;
-
-	if (drvp->mounted)
-		icons[j]->pixbuf = disktypetbl[i].pix_mounted;
-	else
-		icons[j]->pixbuf = disktypetbl[i].pix_normal;
+	icons[j]->drvp	    = drvp;
+	icons[j]->ctxmenu   = NULL;	/* Created on first use. */
+	icons[j]->busy	    = 0;
+	icons[j]->busytimer = 0;
+	icons[j]->pix_busy  = NULL;
+	for (k = 0; k < NCMD_PRIOS; k++)
+		icons[j]->cmds[k] = g_queue_new();
+	set_icon_pixbufs(icons[j]);
 	nicons++;
 	return (icons[j]);
 }
 
+/*
+ * Assigns the rendered pixbufs of the icon's disk type to the icon. The
+ * pixbufs are NULL as long as the main window wasn't created.
+ */
 static void
-del_icon(const char *devname)
+set_icon_pixbufs(icon_t *icon)
 {
 	int i;
 
+	for (i = 0; i < NDSKTYPES; i++) {
+		if (disktypetbl[i].type == icon->drvp->type)
+			break;
+	}
+	if (i == NDSKTYPES)
+		return;
+	icon->pix_normal  = disktypetbl[i].pix_normal;
+	icon->pix_mounted = disktypetbl[i].pix_mounted;
+	if (icon->drvp->mounted)
+		icon->pixbuf = icon->pix_mounted;
+	else
+		icon->pixbuf = icon->pix_normal;
+}
+
+static icon_t *
+lookup_icon(const char *devname)
+{
+	int i;
+
+	for (i = 0; i < nicons; i++) {
+		if (strcmp(icons[i]->drvp->dev, devname) == 0)
+			return (icons[i]);
+	}
+	return (NULL);
+}
+
+static void
+del_icon(const char *devname)
+{
+	int i, j;
+
 	for (i = 0; i < nicons; i++) {
 		if (strcmp(icons[i]->drvp->dev, devname) == 0)
 			break;
 	}
 	if (i == nicons)
 		return;
-	gtk_widget_destroy(icons[i]->ctxmenu->menu);
-	free(icons[i]->ctxmenu);
+	/* Don't leave commands pointing to the icon in the queue. */
+	cancel_cmds(icons[i]);
+	if (icons[i]->ctxmenu != NULL) {
+		gtk_widget_destroy(icons[i]->ctxmenu->menu);
+		free(icons[i]->ctxmenu);
+	}
+	if (icons[i]->busytimer > 0)
+		(void)g_source_remove(icons[i]->busytimer);
+	if (icons[i]->pix_busy != NULL)
+		g_object_unref(icons[i]->pix_busy);
+	for (j = 0; j < NCMD_PRIOS; j++)
+		g_queue_free(icons[i]->cmds[j]);
 	free(icons[i]);
 	for (; i < nicons - 1; i++)
 		icons[i] = icons[i + 1];
@@ -1152,8 +2845,10 @@ create_icon_list()
 {
 	int i;
 
-	for (i = 0; i < ndrives; i++)
-		(void)add_icon(drives[i]);
+	for (i = 0; i < ndrives; i++) {
+		if (!drives[i]->hidden)
+			(void)add_icon(drives[i]);
+	}
 }
 
 static gboolean
@@ -1180,6 +2875,9 @@ icon_clicked(GtkWidget *widget, GdkEvent *event, gpointer data)
 		    &iter, path);
 		gtk_tree_model_get(GTK_TREE_MODEL(mainwin.store), &iter,
 		    COL_ICON, &icon, -1);
+		if (icon->busy > 0)
+			/* Wait for the pending command. */
+			return (FALSE);
 		if ((icon->drvp->cmds  & DRVCMD_PLAY) &&
 		    !(icon->drvp->cmds & DRVCMD_MOUNT))
 			cb_play(NULL, icon);
@@ -1203,6 +2901,9 @@ icon_clicked(GtkWidget *widget, GdkEvent *event, gpointer data)
 		    path);
 		/* Get the disk size. */
 		cb_size(NULL, icon);
+		if (icon->ctxmenu == NULL &&
+		    (icon->ctxmenu = create_ctxmenu(icon)) == NULL)
+			return (FALSE);
 		if ((icon->drvp->cmds & DRVCMD_MOUNT) &&
 		    icon->drvp->mounted) {
 			/*
@@ -1224,6 +2925,8 @@ icon_clicked(GtkWidget *widget, GdkEvent *event, gpointer data)
 			gtk_widget_set_sensitive(
 			    icon->ctxmenu->menuitems[MENU_ITEM_MOUNT], TRUE);
 		}
+		gtk_widget_set_sensitive(
+		    icon->ctxmenu->menuitems[MENU_ITEM_CANCEL], icon->busy > 0);
 #if GTK_MAJOR_VERSION < 3
 		gtk_menu_popup(GTK_MENU(icon->ctxmenu->menu), NULL, NULL,
 		    NULL, NULL, bevent->button, bevent->time);
@@ -1252,114 +2955,673 @@ icon_clicked(GtkWidget *widget, GdkEvent *event, gpointer data)
  * Creates (store == NULL), shrinks or extends a GtkTable, and adds
  * the device icons to it.
  */
-static GtkListStore *
-create_icontbl(GtkListStore *store)
+static GtkListStore *
+create_icontbl(GtkListStore *store)
+{
+	int	    i;
+	gint64	    t0;
+	const char  *sect;
+	GtkTreeIter iter;
+
+	DTRACE_PROBE1(dsbmc, icontbl__start, nicons);
+	sect = wd_enter("icon view rebuild");
+	t0 = g_get_monotonic_time();
+	if (store != NULL) {
+		/* Create a new table. */
+		gtk_list_store_clear(GTK_LIST_STORE(store));
+	} else {
+		store = gtk_list_store_new(NUM_COLS, G_TYPE_STRING,
+		    GDK_TYPE_PIXBUF, G_TYPE_POINTER, ICON_SURFACE_TYPE);
+	}
+	for (i = 0; i < nicons; i++) {
+		gtk_list_store_append(GTK_LIST_STORE(store), &iter);
+		gtk_list_store_set(GTK_LIST_STORE(store), &iter,
+		    COL_NAME, icons[i]->drvp->volid,
+		    COL_ICON, icons[i], -1);
+		icons[i]->iter = iter;
+		if (icons[i]->busy > 0)
+			update_icon(icons[i]);
+		else
+			set_store_icon(&iter, icons[i]->pixbuf);
+	}
+	hist_add(&metrics.icontbl, g_get_monotonic_time() - t0);
+	wd_leave(sect);
+	DTRACE_PROBE1(dsbmc, icontbl__done, nicons);
+
+	return (store);
+}
+
+static void
+update_icons()
+{
+	int i;
+
+	for (i = 0; i < nicons; i++)
+		set_mounted(icons[i], icons[i]->drvp->mounted);
+}
+
+/*
+ * Starts the threads reading the config file and the icon cache. The
+ * icon theme settings are looked up here, since the GTK objects belong to
+ * the main thread.
+ */
+static void
+start_workers()
+{
+	char *theme;
+
+#if GTK_CHECK_VERSION(3, 10, 0)
+	startup.scale = gdk_window_get_scale_factor(
+	    gdk_get_default_root_window());
+#else
+	startup.scale = 1;
+#endif
+	theme = NULL;
+	g_object_get(gtk_settings_get_default(), "gtk-icon-theme-name", &theme,
+	    NULL);
+	startup.theme = theme != NULL ? theme : g_strdup("hicolor");
+	gtk_icon_theme_get_search_path(gtk_icon_theme_get_default(),
+	    &startup.dirs, &startup.ndirs);
+
+	if ((startup.cfgctx = dsbcfg_parser_new()) == NULL)
+		xerr(NULL, EXIT_FAILURE, "dsbcfg_parser_new()");
+	startup.cfgthr  = g_thread_new("config", read_cfg_thread, NULL);
+	startup.iconthr = g_thread_new("icons", load_icons_thread, NULL);
+}
+
+/*
+ * Waits for the startup threads, and applies their results.
+ */
+static void
+join_workers()
+{
+	int  i;
+	char *path;
+
+	cfg = g_thread_join(startup.cfgthr);
+	if (cfg == NULL && startup.cfgerrno == ENOENT) {
+		cfg = dsbcfg_new(NULL, vardefs, CFG_NVARS);
+		if (cfg == NULL)
+			xerrx(NULL, EXIT_FAILURE, "%s", dsbcfg_strerror());
+	} else if (cfg == NULL) {
+		xerrx(NULL, EXIT_FAILURE, "%s",
+		    dsbcfg_strerror_r(startup.cfgctx));
+	}
+	dsbcfg_parser_free(startup.cfgctx);
+	startup.cfgctx = NULL;
+
+	if (g_thread_join(startup.iconthr) == NULL) {
+		/* The icon cache is stale. */
+		resolve_icons(gtk_icon_theme_get_default(), startup.scale);
+		if ((path = iconcache_path()) != NULL) {
+			(void)iconcache_save(path, startup.stamp,
+			    startup.scale);
+		}
+		g_free(path);
+		prof_mark(PROF_PIXBUFS);
+	}
+	g_strfreev(startup.dirs);
+	g_free(startup.theme);
+	startup.dirs  = NULL;
+	startup.theme = NULL;
+	iconscale     = startup.scale;
+	for (i = 0; i < NCMDS; i++)
+		cmdtbl[i].pix = lookup_pixbuf(cmdtbl[i].name);
+
+	/* The drives were added before we knew the ignore list. */
+	for (i = 0; i < ndrives; i++)
+		drives[i]->hidden = drive_hidden(drives[i]);
+	prof_mark(PROF_JOIN);
+}
+
+static gpointer
+read_cfg_thread(gpointer unused)
+{
+	dsbcfg_t *c;
+
+	c = dsbcfg_read_r(startup.cfgctx, PROGRAM, PATH_CONFIG, vardefs,
+	    CFG_NVARS);
+	if (c == NULL)
+		startup.cfgerrno = errno;
+	prof_mark(PROF_CFG_READ);
+
+	return (c);
+}
+
+/*
+ * Loads the icons from the icon cache. Only GLib and GdkPixbuf are used
+ * here. Returns NULL if the cache is missing or stale.
+ */
+static gpointer
+load_icons_thread(gpointer unused)
+{
+	int  ret;
+	char *path;
+
+	startup.stamp = iconcache_stamp(startup.scale, startup.theme,
+	    startup.dirs, startup.ndirs);
+	if ((path = iconcache_path()) == NULL)
+		return (NULL);
+	ret = iconcache_load(path, startup.stamp, startup.scale);
+	g_free(path);
+	if (ret == -1)
+		return (NULL);
+	prof_mark(PROF_PIXBUFS);
+
+	return (GINT_TO_POINTER(1));
+}
+
+/*
+ * Renders the device icons for all disk types.
+ */
+static void
+render_icons()
+{
+	int i;
+
+	for (i = 0; i < NDSKTYPES; i++) {
+		disktypetbl[i].pix_normal =
+		    render_icon(&disktypetbl[i], ICON_STATE_NORMAL);
+		disktypetbl[i].pix_mounted =
+		    render_icon(&disktypetbl[i], ICON_STATE_MOUNTED);
+	}
+}
+
+/*
+ * Resolves all icons from pixbuftbl through the icon theme lookup chain,
+ * and loads them at the given scale factor.
+ */
+static void
+resolve_icons(GtkIconTheme *icon_theme, int scale)
+{
+	int	  i, j;
+	GdkPixbuf *icon;
+
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		for (j = 0; pixbuftbl[i].name[j] != NULL; j++) {
+			icon = load_scaled_icon(icon_theme,
+			    pixbuftbl[i].name[j], pixbuftbl[i].iconsize,
+			    scale);
+			if (icon != NULL)
+				break;
+		}
+		if (icon == NULL) {
+			icon = load_scaled_icon(icon_theme, "missing-image",
+			    pixbuftbl[i].iconsize, scale);
+		}
+		pixbuftbl[i].icon = icon;
+	}
+}
+
+/*
+ * Reloads the icons for a new display scale factor, and updates all
+ * widgets showing them. The icons of the old scale factor remain in the
+ * render cache.
+ */
+static void
+reload_icons(int scale)
+{
+	int	  i;
+	icon_t	  *icon;
+	GdkPixbuf *old[PIXBUFTBLSZ];
+
+	for (i = 0; i < PIXBUFTBLSZ; i++)
+		old[i] = pixbuftbl[i].icon;
+	iconscale = scale;
+	resolve_icons(gtk_icon_theme_get_default(), scale);
+	for (i = 0; i < NCMDS; i++)
+		cmdtbl[i].pix = lookup_pixbuf(cmdtbl[i].name);
+	render_icons();
+	for (i = 0; i < nicons; i++) {
+		icon = icons[i];
+		set_icon_pixbufs(icon);
+		update_icon(icon);
+		/* Recreate the context menu with the new images. */
+		if (icon->ctxmenu != NULL) {
+			gtk_widget_destroy(icon->ctxmenu->menu);
+			free(icon->ctxmenu);
+			icon->ctxmenu = NULL;
+		}
+	}
+	if (mainwin.tray_icon != NULL) {
+		gtk_status_icon_set_from_pixbuf(mainwin.tray_icon,
+		    lookup_pixbuf("dsbmc"));
+	}
+	if (mainwin.win != NULL)
+		gtk_window_set_icon(mainwin.win, lookup_pixbuf("dsbmc"));
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		if (old[i] != NULL)
+			g_object_unref(old[i]);
+	}
+}
+
+#if GTK_CHECK_VERSION(3, 10, 0)
+static void
+scale_changed(GObject *win, GParamSpec *pspec, gpointer unused)
+{
+	int scale;
+
+	scale = gtk_widget_get_scale_factor(GTK_WIDGET(win));
+	if (scale != iconscale)
+		reload_icons(scale);
+}
+#endif
+
+static uint64_t
+fnv1a(uint64_t h, const void *data, size_t len)
+{
+	const u_char *p;
+
+	for (p = data; len-- > 0; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+	return (h);
+}
+
+/*
+ * Returns the path to the icon cache file, and creates its parent dir
+ * if necessary.
+ */
+static char *
+iconcache_path()
+{
+	char *dir, *path;
+
+	dir = g_build_filename(g_get_user_cache_dir(), PROGRAM, NULL);
+	if (g_mkdir_with_parents(dir, S_IRWXU) == -1) {
+		warn("mkdir(%s)", dir);
+		g_free(dir);
+		return (NULL);
+	}
+	path = g_build_filename(dir, PATH_ICON_CACHE, NULL);
+	g_free(dir);
+
+	return (path);
+}
+
+/*
+ * Computes the stamp the icon cache is valid for. It is a hash over the
+ * theme name, the scale factor, and the mtimes of the icon search path dirs,
+ * the theme dirs and their icon-theme.cache files. The themes are not
+ * loaded, and no icon lookup takes place.
+ */
+static uint64_t
+iconcache_stamp(int scale, const char *theme, char **dirs, int ndirs)
+{
+	int	    i, j, k;
+	char	    path[PATH_MAX];
+	uint64_t    h;
+	const char  *themes[2], *files[] = { "", "/icon-theme.cache" };
+	struct stat sb;
+
+	themes[0] = theme;
+	themes[1] = "hicolor";
+
+	h = fnv1a(0xcbf29ce484222325ULL, themes[0], strlen(themes[0]));
+	h = fnv1a(h, &scale, sizeof(scale));
+	for (i = 0; i < ndirs; i++) {
+		if (stat(dirs[i], &sb) == 0)
+			h = fnv1a(h, &sb.st_mtime, sizeof(sb.st_mtime));
+		for (j = 0; j < 2; j++) {
+			for (k = 0; k < 2; k++) {
+				(void)snprintf(path, sizeof(path), "%s/%s%s",
+				    dirs[i], themes[j], files[k]);
+				if (stat(path, &sb) == -1)
+					continue;
+				h = fnv1a(h, path, strlen(path));
+				h = fnv1a(h, &sb.st_mtime, sizeof(sb.st_mtime));
+			}
+		}
+	}
+	return (h);
+}
+
+/*
+ * Maps the icon cache file into memory, and creates the pixbufs of
+ * pixbuftbl from the mapped pixel data. The mapping is kept for the
+ * lifetime of the process.
+ *
+ * Returns -1 if the cache doesn't exist, is stale, incomplete or corrupt.
+ */
+static int
+iconcache_load(const char *path, uint64_t stamp, int scale)
+{
+	int		       i, j, fd;
+	u_char		       *map;
+	size_t		       maplen;
+	GdkPixbuf	       *pix[PIXBUFTBLSZ];
+	struct stat	       sb;
+	struct iconcache_hdr_s *hdr;
+	struct iconcache_ent_s *ent;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(*hdr) ||
+	    (uintmax_t)sb.st_size > SIZE_MAX) {
+		(void)close(fd);
+		return (-1);
+	}
+	maplen = (size_t)sb.st_size;
+	map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED)
+		return (-1);
+	i   = 0;
+	hdr = (struct iconcache_hdr_s *)map;
+	ent = (struct iconcache_ent_s *)(map + sizeof(*hdr));
+	if (hdr->magic != ICON_CACHE_MAGIC    ||
+	    hdr->version != ICON_CACHE_VERSION ||
+	    hdr->scale != scale || hdr->stamp != stamp ||
+	    hdr->nentries > (maplen - sizeof(*hdr)) / sizeof(*ent))
+		goto error;
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		for (j = 0; j < hdr->nentries; j++) {
+			if (ent[j].size == pixbuftbl[i].iconsize &&
+			    strncmp(ent[j].id, pixbuftbl[i].id,
+			    sizeof(ent[j].id)) == 0)
+				break;
+		}
+		pix[i] = NULL;
+		if (j == hdr->nentries)
+			goto error;
+		if (ent[j].width == 0)
+			continue;
+		if (!iconcache_entry_ok(&ent[j], maplen))
+			goto error;
+		pix[i] = gdk_pixbuf_new_from_data(map + ent[j].offset,
+		    GDK_COLORSPACE_RGB, ent[j].alpha, 8, ent[j].width,
+		    ent[j].height, ent[j].rowstride, NULL, NULL);
+	}
+	for (i = 0; i < PIXBUFTBLSZ; i++)
+		pixbuftbl[i].icon = pix[i];
+	return (0);
+error:
+	while (i-- > 0) {
+		if (pix[i] != NULL)
+			g_object_unref(pix[i]);
+	}
+	(void)munmap(map, maplen);
+	return (-1);
+}
+
+/*
+ * Checks whether the given cache entry describes a pixbuf whose pixel data
+ * lies completely within the mapped file of 'maplen' bytes. The entry comes
+ * from disk, so all sizes are checked before they are multiplied.
+ */
+static bool
+iconcache_entry_ok(const struct iconcache_ent_s *ent, size_t maplen)
+{
+	size_t rowlen, minlen;
+
+	if (ent->width <= 0 || ent->width > ICON_CACHE_MAXDIM ||
+	    ent->height <= 0 || ent->height > ICON_CACHE_MAXDIM ||
+	    ent->rowstride <= 0 || (ent->alpha != 0 && ent->alpha != 1))
+		return (false);
+	rowlen = (size_t)ent->width * (ent->alpha ? 4 : 3);
+	if ((size_t)ent->rowstride < rowlen)
+		return (false);
+	if ((size_t)(ent->height - 1) > (SIZE_MAX - rowlen) /
+	    (size_t)ent->rowstride)
+		return (false);
+	minlen = (size_t)(ent->height - 1) * (size_t)ent->rowstride + rowlen;
+	if (ent->len < minlen || ent->offset > maplen ||
+	    ent->len > maplen - ent->offset)
+		return (false);
+	return (true);
+}
+
+/*
+ * Writes the pixel data of all icons from pixbuftbl to the cache file.
+ */
+static int
+iconcache_save(const char *path, uint64_t stamp, int scale)
+{
+	int		       i, fd;
+	char		       *tmpl;
+	FILE		       *fp;
+	GdkPixbuf	       *pix;
+	uint64_t	       offset;
+	struct iconcache_hdr_s hdr;
+	struct iconcache_ent_s ent[PIXBUFTBLSZ];
+
+	(void)memset(&hdr, 0, sizeof(hdr));
+	(void)memset(ent, 0, sizeof(ent));
+	hdr.magic    = ICON_CACHE_MAGIC;
+	hdr.version  = ICON_CACHE_VERSION;
+	hdr.nentries = PIXBUFTBLSZ;
+	hdr.scale    = scale;
+	hdr.stamp    = stamp;
+
+	offset = sizeof(hdr) + sizeof(ent);
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		(void)strncpy(ent[i].id, pixbuftbl[i].id, sizeof(ent[i].id));
+		ent[i].size = pixbuftbl[i].iconsize;
+		if ((pix = pixbuftbl[i].icon) == NULL)
+			continue;
+		if (gdk_pixbuf_get_bits_per_sample(pix) != 8 ||
+		    gdk_pixbuf_get_n_channels(pix) !=
+		    (gdk_pixbuf_get_has_alpha(pix) ? 4 : 3))
+			continue;
+		ent[i].width	 = gdk_pixbuf_get_width(pix);
+		ent[i].height	 = gdk_pixbuf_get_height(pix);
+		ent[i].rowstride = gdk_pixbuf_get_rowstride(pix);
+		ent[i].alpha	 = gdk_pixbuf_get_has_alpha(pix);
+		ent[i].len	 = (ent[i].height - 1) * ent[i].rowstride +
+		    ent[i].width * gdk_pixbuf_get_n_channels(pix);
+		ent[i].offset	 = offset;
+		/* Keep the pixel data 8 byte aligned. */
+		offset += (ent[i].len + 7) & ~(uint64_t)7;
+	}
+	if ((tmpl = g_strdup_printf("%s.XXXXXX", path)) == NULL)
+		return (-1);
+	if ((fd = mkstemp(tmpl)) == -1) {
+		warn("mkstemp(%s)", tmpl);
+		g_free(tmpl);
+		return (-1);
+	}
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		warn("fdopen()");
+		(void)close(fd);
+		goto error;
+	}
+	(void)fwrite(&hdr, sizeof(hdr), 1, fp);
+	(void)fwrite(ent, sizeof(ent), 1, fp);
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		if (ent[i].width == 0)
+			continue;
+		(void)fseeko(fp, ent[i].offset, SEEK_SET);
+		(void)fwrite(gdk_pixbuf_get_pixels(pixbuftbl[i].icon),
+		    ent[i].len, 1, fp);
+	}
+	if (ferror(fp) || fclose(fp) != 0) {
+		warn("Couldn't write icon cache %s", tmpl);
+		goto error;
+	}
+	if (rename(tmpl, path) == -1) {
+		warn("rename(%s, %s)", tmpl, path);
+		goto error;
+	}
+	g_free(tmpl);
+	return (0);
+error:
+	(void)unlink(tmpl);
+	g_free(tmpl);
+	return (-1);
+}
+
+/*
+ * Returns the device icon for the given disk type and state. Icons of
+ * mounted devices are composited from the disk type icon and the mount
+ * emblem. The result is kept in the render cache.
+ */
+static GdkPixbuf *
+render_icon(const struct disktypetbl_s *dt, int state)
 {
-	int	    i;
-	GtkTreeIter iter;
-
-	if (store != NULL) {
-		/* Create a new table. */
-		gtk_list_store_clear(GTK_LIST_STORE(store));
-	} else {
-		store = gtk_list_store_new(NUM_COLS, G_TYPE_STRING,
-		    GDK_TYPE_PIXBUF, G_TYPE_POINTER, G_TYPE_STRING);
+	int	  i, w, h, ew, eh;
+	GdkPixbuf *base, *emblem, *pix;
+	struct rendercache_s *rc;
+
+	for (i = 0; i < nrendered; i++) {
+		if (rendercache[i].type == dt->type   &&
+		    rendercache[i].state == state     &&
+		    rendercache[i].size == ICON_SIZE_ICON &&
+		    rendercache[i].scale == iconscale)
+			return (rendercache[i].pix);
 	}
-	for (i = 0; i < nicons; i++) {
-		gtk_list_store_append(GTK_LIST_STORE(store), &iter);
-		gtk_list_store_set(GTK_LIST_STORE(store), &iter,
-		    COL_NAME, icons[i]->drvp->volid,
-		    COL_PIXBUF, icons[i]->pixbuf,
-		    COL_ICON, icons[i], -1);
-		icons[i]->iter = iter;
+	if ((base = lookup_pixbuf(dt->name)) == NULL)
+		return (NULL);
+	if (state == ICON_STATE_NORMAL)
+		pix = g_object_ref(base);
+	else if ((emblem = lookup_pixbuf("mounted")) == NULL)
+		pix = g_object_ref(base);
+	else {
+		/* Place the emblem in the lower right corner. */
+		pix = gdk_pixbuf_add_alpha(base, FALSE, 0, 0, 0);
+		w   = gdk_pixbuf_get_width(pix);
+		h   = gdk_pixbuf_get_height(pix);
+		ew  = MIN(gdk_pixbuf_get_width(emblem), w);
+		eh  = MIN(gdk_pixbuf_get_height(emblem), h);
+		gdk_pixbuf_composite(emblem, pix, w - ew, h - eh, ew, eh,
+		    w - ew, h - eh, 1.0, 1.0, GDK_INTERP_BILINEAR, 255);
 	}
-	return (store);
+	rc = realloc(rendercache, (nrendered + 1) * sizeof(*rendercache));
+	if (rc == NULL)
+		xerr(NULL, EXIT_FAILURE, "realloc()");
+	rendercache = rc;
+	rc = &rendercache[nrendered++];
+	rc->type  = dt->type;
+	rc->state = state;
+	rc->size  = ICON_SIZE_ICON;
+	rc->scale = iconscale;
+	rc->pix   = pix;
+
+	return (pix);
 }
 
-static void
-update_icons()
+static GdkPixbuf *
+lookup_pixbuf(const char *id)
 {
 	int i;
 
-	for (i = 0; i < nicons; i++)
-		set_mounted(icons[i], icons[i]->drvp->mounted);
+	for (i = 0; i < PIXBUFTBLSZ; i++) {
+		if (strcmp(pixbuftbl[i].id, id) == 0)
+			return (pixbuftbl[i].icon);
+	}
+	return (NULL);
 }
 
+/*
+ * Marks the icon as busy while dsbmd executes a command on its device, or
+ * clears the mark when the reply arrived. The icon is shown dimmed if the
+ * reply takes longer than busy_delay ms. Other icons remain usable.
+ */
 static void
-load_pixbufs()
+set_busy(icon_t *icon, bool busy)
 {
-	int	      i, j;
-	GdkPixbuf    *icon;
-	GtkIconTheme *icon_theme;
+	int delay;
 
-	icon_theme = gtk_icon_theme_get_default();
-	for (i = 0; i < PIXBUFTBLSZ; i++) {
-		for (j = 0; pixbuftbl[i].name[j] != NULL; j++) {
-			icon = gtk_icon_theme_load_icon(icon_theme,
-			    pixbuftbl[i].name[j], pixbuftbl[i].iconsize,
-			    ICON_LOOKUP_FLAGS, NULL);
-			if (icon != NULL)
-				break;
-		}
-		if (icon == NULL) {
-			icon = gtk_icon_theme_load_icon(icon_theme,
-			    "missing-image", pixbuftbl[i].iconsize,
-			    ICON_LOOKUP_FLAGS, NULL);
+	if (busy) {
+		if (icon->busy++ > 0)
+			return;
+		if ((delay = dsbcfg_getval(cfg, CFG_BUSY_DELAY).integer) <= 0)
+			update_icon(icon);
+		else {
+			icon->busytimer = g_timeout_add(delay, busy_timeout,
+			    icon);
 		}
-		pixbuftbl[i].icon = icon;
-	}
-	for (i = 0; i < NDSKTYPES; i++) {
-		disktypetbl[i].pix_normal  = lookup_pixbuf(disktypetbl[i].name);
-		disktypetbl[i].pix_mounted = lookup_pixbuf("mounted");
+		return;
 	}
-	for (i = 0; i < NCMDS; i++)
-		cmdtbl[i].pix = lookup_pixbuf(cmdtbl[i].name);
+	if (icon->busy == 0 || --icon->busy > 0)
+		return;
+	if (icon->busytimer > 0) {
+		/* The reply came in time. The icon was never dimmed. */
+		(void)g_source_remove(icon->busytimer);
+		icon->busytimer = 0;
+	} else
+		update_icon(icon);
 }
 
-static GdkPixbuf *
-lookup_pixbuf(const char *id)
+static gboolean
+busy_timeout(gpointer data)
 {
-	int i;
+	icon_t *icon = (icon_t *)data;
 
-	for (i = 0; i < PIXBUFTBLSZ; i++) {
-		if (strcmp(pixbuftbl[i].id, id) == 0)
-			return (pixbuftbl[i].icon);
+	icon->busytimer = 0;
+	update_icon(icon);
+
+	return (FALSE);
+}
+
+/*
+ * Sets the icon's pixbuf in the icon view. The pixbuf is dimmed while a
+ * command on the device is pending.
+ */
+static void
+update_icon(icon_t *icon)
+{
+	GdkPixbuf *pix;
+
+	if (icon->pix_busy != NULL) {
+		g_object_unref(icon->pix_busy);
+		icon->pix_busy = NULL;
 	}
-	return (NULL);
+	pix = icon->pixbuf;
+	if (icon->busy > 0 && icon->busytimer == 0 && pix != NULL &&
+	    (icon->pix_busy = gdk_pixbuf_copy(pix)) != NULL) {
+		gdk_pixbuf_saturate_and_pixelate(pix, icon->pix_busy, 0.3,
+		    TRUE);
+		pix = icon->pix_busy;
+	}
+	set_store_icon(&icon->iter, pix);
 }
 
+/*
+ * Sets the image of the icon view item at 'iter'. With GTK >= 3.10, the
+ * view shows a surface with the device scale of the icons.
+ */
 static void
-busywin(const char *msg, bool show)
+set_store_icon(GtkTreeIter *iter, GdkPixbuf *pix)
 {
-	static GtkWidget *spinner, *label, *hbox, *win = NULL;
+#if GTK_CHECK_VERSION(3, 10, 0)
+	cairo_surface_t *surface;
 
-	if (!show) {
-		if (win != NULL)
-			gtk_widget_destroy(win);
-		win = NULL;
-		return;
+	surface = NULL;
+	if (pix != NULL) {
+		surface = gdk_cairo_surface_create_from_pixbuf(pix, iconscale,
+		    NULL);
 	}
-	win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
-	gtk_window_set_decorated(GTK_WINDOW(win), FALSE);
-	gtk_window_set_transient_for(GTK_WINDOW(win), GTK_WINDOW(mainwin.win));
-	gtk_window_set_modal(GTK_WINDOW(win), TRUE);
-	gtk_window_set_position(GTK_WINDOW(win), GTK_WIN_POS_CENTER_ON_PARENT);
-	gtk_container_set_border_width(GTK_CONTAINER(win), 10);
+	gtk_list_store_set(GTK_LIST_STORE(mainwin.store), iter,
+	    COL_PIXBUF, pix, COL_SURFACE, surface, -1);
+	if (surface != NULL)
+		cairo_surface_destroy(surface);
+#else
+	gtk_list_store_set(GTK_LIST_STORE(mainwin.store), iter,
+	    COL_PIXBUF, pix, -1);
+#endif
+}
 
-	label = new_label(ALIGN_CENTER, ALIGN_CENTER, msg);
+/*
+ * Creates an image widget showing the given icon at its logical size.
+ */
+static GtkWidget *
+new_icon_image(GdkPixbuf *pix)
+{
+#if GTK_CHECK_VERSION(3, 10, 0)
+	GtkWidget	*image;
+	cairo_surface_t *surface;
 
-	spinner = gtk_spinner_new();
-	gtk_spinner_start(GTK_SPINNER(spinner));
+	if (pix == NULL)
+		return (gtk_image_new());
+	surface = gdk_cairo_surface_create_from_pixbuf(pix, iconscale, NULL);
+	image	= gtk_image_new_from_surface(surface);
+	cairo_surface_destroy(surface);
 
-#if GTK_MAJOR_VERSION < 3
-	hbox = gtk_hbox_new(FALSE, 5);
+	return (image);
 #else
-	hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
+	return (gtk_image_new_from_pixbuf(pix));
 #endif
-	gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, FALSE, 0);
-	gtk_box_pack_start(GTK_BOX(hbox), spinner, TRUE, FALSE, 0);
-	gtk_container_add(GTK_CONTAINER(win), hbox);
-	gtk_widget_show_all(win);
 }
 
 static void
@@ -1369,8 +3631,7 @@ set_mounted(icon_t *icon, bool mounted)
 		icon->pixbuf = icon->pix_mounted;
 	else
 		icon->pixbuf = icon->pix_normal;
-	gtk_list_store_set(GTK_LIST_STORE(mainwin.store), &icon->iter,
-	    COL_PIXBUF, icon->pixbuf, -1);
+	update_icon(icon);
 }
 
 static const char *
@@ -1400,8 +3661,10 @@ readln(bool block)
 			    _("Lost connection to DSBMD"));
 		} else if (!block)
 			return (NULL);
-	} else
+	} else {
+		record(REC_LINE, "%s", buf);
 		return (buf);
+	}
 	FD_ZERO(&rset); FD_SET(fileno(sock), &rset);
 	/* Block until data is available. */
 	while (select(fileno(sock) + 1, &rset, NULL, NULL, NULL) == -1) {
@@ -1410,6 +3673,7 @@ readln(bool block)
 	}
 	if ((p = fgets(buf, sizeof(buf), sock)) == NULL)
 		xerrx(mainwin.win, EXIT_FAILURE, _("Lost connection to DSBMD"));
+	record(REC_LINE, "%s", buf);
 	return (p);
 }
 
@@ -1444,139 +3708,687 @@ lookupdrv_from_mnt(const char *mnt)
 
 }
 
-static gboolean
-readevent(GIOChannel *ioc, GIOCondition cond, gpointer data)
+static gboolean
+readevent(GIOChannel *ioc, GIOCondition cond, gpointer data)
+{
+	int	   n;
+	char	   *p;
+	gint64	   t0;
+	const char *sect;
+
+	DTRACE_PROBE(dsbmc, readevent__start);
+	sect = wd_enter("readevent");
+	t0 = g_get_monotonic_time();
+	for (n = 0; (p = readln(false)) != NULL; n++) {
+		switch (process_event(p)) {
+		case EVENT_SUCCESS_MSG:
+		case EVENT_ERROR_MSG:
+			call_reply_function();
+		}
+	}
+	hist_add(&metrics.dispatch, g_get_monotonic_time() - t0);
+	wd_leave(sect);
+	DTRACE_PROBE1(dsbmc, readevent__done, n);
+
+	return (TRUE);
+}
+
+/*
+ * Called from the main loop if a launched command terminated. Moves the
+ * job from the table of running jobs to the history.
+ */
+static void
+child_exited(GPid pid, gint status, gpointer data)
+{
+	job_t *job = (job_t *)data;
+
+	job->status  = status;
+	job->running = false;
+	job->end     = g_get_monotonic_time();
+	g_spawn_close_pid(pid);
+	(void)g_hash_table_remove(jobs, GINT_TO_POINTER(pid));
+	g_queue_push_head(jobhist, job);
+	if (g_queue_get_length(jobhist) > JOB_HISTORY)
+		free_job(g_queue_pop_tail(jobhist));
+	update_jobs_window();
+
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_ENOENT) {
+		/* We couldn't execute the program. */
+		errno = ENOENT;
+		xwarn(mainwin.win, _("Couldn't execute command \"%s\""),
+		    job->cmdstr);
+	}
+}
+
+static void
+free_job(job_t *job)
+{
+	g_free(job->cmdstr);
+	free(job);
+}
+
+/*
+ * Shows a window listing the running jobs, and the recently finished
+ * ones with their exit status.
+ */
+static void
+jobs_window()
+{
+	GtkWidget	  *sw, *tv;
+	GtkCellRenderer	  *renderer;
+	GtkTreeViewColumn *col;
+	const char	  *titles[JOB_NCOLS] = {
+		"PID", "Command", "Status", "Time"
+	};
+	int		  i;
+
+	if (jobswin.win != NULL) {
+		gtk_window_present(GTK_WINDOW(jobswin.win));
+		return;
+	}
+	jobswin.win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(jobswin.win), _("Jobs"));
+	gtk_window_set_icon_name(GTK_WINDOW(jobswin.win), "system-run");
+	gtk_window_set_default_size(GTK_WINDOW(jobswin.win), 500, 250);
+	gtk_container_set_border_width(GTK_CONTAINER(jobswin.win), 5);
+
+	jobswin.store = gtk_list_store_new(JOB_NCOLS, G_TYPE_INT,
+	    G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+	tv = gtk_tree_view_new_with_model(GTK_TREE_MODEL(jobswin.store));
+	g_object_unref(jobswin.store);
+	for (i = 0; i < JOB_NCOLS; i++) {
+		renderer = gtk_cell_renderer_text_new();
+		col = gtk_tree_view_column_new_with_attributes(_(titles[i]),
+		    renderer, "text", i, NULL);
+		gtk_tree_view_column_set_resizable(col, TRUE);
+		gtk_tree_view_column_set_expand(col, i == JOB_COL_CMD);
+		gtk_tree_view_append_column(GTK_TREE_VIEW(tv), col);
+	}
+	sw = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
+	    GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(sw), tv);
+	gtk_container_add(GTK_CONTAINER(jobswin.win), sw);
+
+	g_signal_connect(G_OBJECT(jobswin.win), "destroy",
+	    G_CALLBACK(jobs_window_destroyed), NULL);
+	update_jobs_window();
+	/* Update the running times every second. */
+	jobswin.timer = g_timeout_add_seconds(1, jobs_timer, NULL);
+	gtk_widget_show_all(jobswin.win);
+}
+
+static void
+jobs_window_destroyed(GtkWidget *win, gpointer unused)
+{
+	if (jobswin.timer > 0)
+		(void)g_source_remove(jobswin.timer);
+	jobswin.timer = 0;
+	jobswin.win   = NULL;
+	jobswin.store = NULL;
+}
+
+static gboolean
+jobs_timer(gpointer unused)
+{
+	update_jobs_window();
+
+	return (TRUE);
+}
+
+static void
+add_job_row(job_t *job)
+{
+	char	    status[64], tm[32];
+	gint64	    usecs;
+	GtkTreeIter iter;
+
+	if (job->running) {
+		(void)strncpy(status, _("Running"), sizeof(status) - 1);
+		status[sizeof(status) - 1] = '\0';
+		usecs = g_get_monotonic_time() - job->start;
+	} else {
+		if (WIFSIGNALED(job->status)) {
+			(void)snprintf(status, sizeof(status),
+			    _("Killed by signal %d"), WTERMSIG(job->status));
+		} else {
+			(void)snprintf(status, sizeof(status),
+			    _("Exit code %d"), WEXITSTATUS(job->status));
+		}
+		usecs = job->end - job->start;
+	}
+	(void)snprintf(tm, sizeof(tm), "%.1f s", usecs / 1000000.0);
+	gtk_list_store_append(jobswin.store, &iter);
+	gtk_list_store_set(jobswin.store, &iter,
+	    JOB_COL_PID, job->pid, JOB_COL_CMD, job->cmdstr,
+	    JOB_COL_STATUS, status, JOB_COL_TIME, tm, -1);
+}
+
+/*
+ * Refills the jobs window's list, if the window exists.
+ */
+static void
+update_jobs_window()
+{
+	GList	       *l;
+	gpointer       job;
+	GHashTableIter it;
+
+	if (jobswin.win == NULL)
+		return;
+	gtk_list_store_clear(jobswin.store);
+	g_hash_table_iter_init(&it, jobs);
+	while (g_hash_table_iter_next(&it, NULL, &job))
+		add_job_row(job);
+	for (l = jobhist->head; l != NULL; l = l->next)
+		add_job_row(l->data);
+}
+
+/*
+ * Shows a window with the latency metrics.
+ */
+static void
+diag_window()
+{
+	GtkWidget *sw, *tv;
+
+	if (diagwin.win != NULL) {
+		gtk_window_present(GTK_WINDOW(diagwin.win));
+		return;
+	}
+	diagwin.win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+	gtk_window_set_title(GTK_WINDOW(diagwin.win), _("Diagnostics"));
+	gtk_window_set_icon_name(GTK_WINDOW(diagwin.win),
+	    "utilities-system-monitor");
+	gtk_window_set_default_size(GTK_WINDOW(diagwin.win), 560, 350);
+	gtk_container_set_border_width(GTK_CONTAINER(diagwin.win), 5);
+
+	tv = gtk_text_view_new();
+	gtk_text_view_set_editable(GTK_TEXT_VIEW(tv), FALSE);
+#if GTK_CHECK_VERSION(3, 16, 0)
+	gtk_text_view_set_monospace(GTK_TEXT_VIEW(tv), TRUE);
+#endif
+	diagwin.buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(tv));
+	sw = gtk_scrolled_window_new(NULL, NULL);
+	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(sw),
+	    GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+	gtk_container_add(GTK_CONTAINER(sw), tv);
+	gtk_container_add(GTK_CONTAINER(diagwin.win), sw);
+
+	g_signal_connect(G_OBJECT(diagwin.win), "destroy",
+	    G_CALLBACK(diag_window_destroyed), NULL);
+	update_diag_window();
+	diagwin.timer = g_timeout_add_seconds(1, diag_timer, NULL);
+	gtk_widget_show_all(diagwin.win);
+}
+
+static void
+diag_window_destroyed(GtkWidget *win, gpointer unused)
+{
+	if (diagwin.timer > 0)
+		(void)g_source_remove(diagwin.timer);
+	diagwin.timer = 0;
+	diagwin.win   = NULL;
+	diagwin.buf   = NULL;
+}
+
+static gboolean
+diag_timer(gpointer unused)
+{
+	update_diag_window();
+
+	return (TRUE);
+}
+
+static void
+update_diag_window()
+{
+	char	buf[160];
+	u_int	i;
+	gint64	now;
+	GString *str;
+
+	if (diagwin.win == NULL)
+		return;
+	str = metrics_report();
+	g_string_append_c(str, '\n');
+	now = g_get_monotonic_time();
+	for (i = 0; i < MIN(flightrec.n, FLIGHTREC_SIZE); i++) {
+		format_record(i, now, buf, sizeof(buf));
+		g_string_append(str, buf);
+	}
+	gtk_text_buffer_set_text(diagwin.buf, str->str, -1);
+	(void)g_string_free(str, TRUE);
+}
+
+/*
+ * Compiles the command templates of the global section. If 'vars' is not
+ * NULL, only the templates of the variables flagged in 'vars' are
+ * compiled.
+ */
+static void
+compile_cmdtmpls(const bool *vars)
+{
+	int	   i, var;
+	char	   *str;
+	const char *errmsg;
+
+	for (i = 0; i < NCMDTMPLS; i++) {
+		var = cmdtmplvars[i];
+		if (vars != NULL && !vars[var])
+			continue;
+		free_cmdtmpl(cmdtmpls[var]);
+		cmdtmpls[var] = NULL;
+		if ((str = dsbcfg_getval(cfg, var).string) == NULL)
+			continue;
+		if ((cmdtmpls[var] = compile_cmdtmpl(str, &errmsg)) == NULL)
+			xwarnx(NULL, "%s: %s", dsbcfg_varname(cfg, var), errmsg);
+	}
+	cfggen++;
+}
+
+/*
+ * Compiles the commands set in the device sections. The templates are
+ * stored by section label.
+ */
+static void
+compile_sect_cmdtmpls()
+{
+	int	   i, var;
+	char	   *str, *label;
+	dsbcfg_t   *cp;
+	cmdtmpl_t  **tmpls;
+	const char *errmsg;
+
+	if (sectmpls == NULL) {
+		sectmpls = g_hash_table_new_full(g_str_hash, g_str_equal,
+		    free, free_sectmpls);
+	} else
+		g_hash_table_remove_all(sectmpls);
+	for (cp = cfg; cp != NULL; cp = cp->next) {
+		if (cp->label == NULL)
+			continue;
+		if ((tmpls = calloc(CFG_NVARS, sizeof(*tmpls))) == NULL)
+			xerr(NULL, EXIT_FAILURE, "calloc()");
+		for (i = 0; i < NCMDTMPLS; i++) {
+			var = cmdtmplvars[i];
+			if (!dsbcfg_isset(cp, var) ||
+			    (str = dsbcfg_getval(cp, var).string) == NULL)
+				continue;
+			if ((tmpls[var] = compile_cmdtmpl(str, &errmsg)) == NULL) {
+				xwarnx(NULL, "%s: %s: %s", cp->label,
+				    dsbcfg_varname(cp, var), errmsg);
+			}
+		}
+		if ((label = strdup(cp->label)) == NULL)
+			xerr(NULL, EXIT_FAILURE, "strdup()");
+		g_hash_table_insert(sectmpls, label, tmpls);
+	}
+	cfggen++;
+}
+
+static void
+free_sectmpls(gpointer data)
+{
+	int	  i;
+	cmdtmpl_t **tmpls = data;
+
+	for (i = 0; i < NCMDTMPLS; i++)
+		free_cmdtmpl(tmpls[cmdtmplvars[i]]);
+	free(tmpls);
+}
+
+/*
+ * Compiles the given command string into a list of segments. If the
+ * string uses any shell syntax other than quoting, the template will be
+ * executed by the shell. Returns NULL, and sets 'errmsg' if the string
+ * is invalid.
+ */
+static cmdtmpl_t *
+compile_cmdtmpl(const char *str, const char **errmsg)
+{
+	int	  ret;
+	cmdtmpl_t *tmpl;
+
+	if ((tmpl = malloc(sizeof(cmdtmpl_t))) == NULL)
+		xerr(NULL, EXIT_FAILURE, "malloc()");
+	tmpl->shell = false;
+	tmpl->segs  = NULL;
+	if ((tmpl->str = strdup(str)) == NULL ||
+	    (tmpl->buf = malloc(strlen(str) + 1)) == NULL)
+		xerr(NULL, EXIT_FAILURE, "malloc()");
+	if ((ret = parse_cmdtmpl(tmpl, errmsg)) == 1) {
+		tmpl->shell = true;
+		ret = parse_cmdtmpl(tmpl, errmsg);
+	}
+	if (ret != 0) {
+		free_cmdtmpl(tmpl);
+		return (NULL);
+	}
+	return (tmpl);
+}
+
+/*
+ * Splits the template string into segments. In direct mode, the string
+ * is split into words following the quoting rules of sh(1), and 1 is
+ * returned if the string requires the shell. In shell mode, the text is
+ * kept as is, and only the quote context of the field codes is recorded.
+ */
+static int
+parse_cmdtmpl(cmdtmpl_t *tmpl, const char **errmsg)
+{
+	int	    wseg;
+	char	    quote, *p, *lit;
+	bool	    inword;
+	const char  *s;
+	static char errbuf[64];
+
+	tmpl->nwords = tmpl->nsegs = wseg = 0;
+	for (s = tmpl->str, p = lit = tmpl->buf, quote = '\0', inword = false;;
+	    s++) {
+		if (*s == '%' && s[1] == '%') {
+			*p++ = *++s; inword = true;
+			continue;
+		} else if (*s == '%') {
+			if (s[1] == '\0') {
+				*errmsg = _("Incomplete field code");
+				return (-1);
+			} else if (strchr(FIELD_CODES, s[1]) == NULL) {
+				(void)snprintf(errbuf, sizeof(errbuf),
+				    _("Unknown field code '%%%c'"), s[1]);
+				*errmsg = errbuf;
+				return (-1);
+			}
+			if (p > lit)
+				add_tmplseg(tmpl, '\0', quote, lit, p - lit);
+			add_tmplseg(tmpl, *++s, quote, NULL, 0);
+			lit = p; inword = true;
+			continue;
+		}
+		if (tmpl->shell) {
+			if (*s == '\0')
+				break;
+			if (quote == '\'') {
+				if (*s == '\'')
+					quote = '\0';
+			} else if (*s == '\'' || *s == '"') {
+				if (quote == '\0')
+					quote = *s;
+				else if (*s == '"')
+					quote = '\0';
+			} else if (*s == '\\' && s[1] != '\0')
+				*p++ = *s++;
+			*p++ = *s;
+			continue;
+		}
+		if (quote == '\'') {
+			if (*s == '\0')
+				return (1);
+			if (*s == '\'')
+				quote = '\0';
+			else
+				*p++ = *s;
+			continue;
+		} else if (quote == '"') {
+			if (*s == '\0' || *s == '$' || *s == '`')
+				return (1);
+			if (*s == '"')
+				quote = '\0';
+			else if (*s == '\\' && s[1] != '\0' &&
+			    strchr("\"\\$`", s[1]) != NULL)
+				*p++ = *++s;
+			else
+				*p++ = *s;
+			continue;
+		}
+		if (*s == '\0' || *s == ' ' || *s == '\t') {
+			if (inword) {
+				/* Empty words ("") need a segment, too. */
+				if (p > lit || tmpl->nsegs == wseg)
+					add_tmplseg(tmpl, '\0', '\0', lit,
+					    p - lit);
+				lit = p; inword = false;
+				wseg = tmpl->nsegs;
+				tmpl->nwords++;
+			}
+			if (*s == '\0')
+				break;
+			continue;
+		}
+		if (*s == '\'' || *s == '"') {
+			quote = *s;
+		} else if (*s == '\\') {
+			if (s[1] == '\0')
+				return (1);
+			*p++ = *++s;
+		} else if (strchr("|&;<>()$`*?[\n", *s) != NULL ||
+		    (!inword && (*s == '#' || *s == '~')) ||
+		    (*s == '=' && tmpl->nwords == 0)) {
+			return (1);
+		} else
+			*p++ = *s;
+		inword = true;
+	}
+	if (tmpl->shell) {
+		if (quote != '\0') {
+			*errmsg = _("Unterminated quote");
+			return (-1);
+		}
+		if (p > lit)
+			add_tmplseg(tmpl, '\0', '\0', lit, p - lit);
+		tmpl->nwords = 1;
+	}
+	return (0);
+}
+
+static void
+add_tmplseg(cmdtmpl_t *tmpl, char code, char quote, char *text, size_t len)
+{
+	struct tmplseg_s *segs;
+
+	segs = realloc(tmpl->segs, (tmpl->nsegs + 1) * sizeof(*segs));
+	if (segs == NULL)
+		xerr(NULL, EXIT_FAILURE, "realloc()");
+	segs[tmpl->nsegs].code	= code;
+	segs[tmpl->nsegs].quote = quote;
+	segs[tmpl->nsegs].word	= tmpl->shell ? 0 : tmpl->nwords;
+	segs[tmpl->nsegs].text	= text;
+	segs[tmpl->nsegs].len	= len;
+	tmpl->segs = segs;
+	tmpl->nsegs++;
+}
+
+static void
+free_cmdtmpl(cmdtmpl_t *tmpl)
+{
+	if (tmpl == NULL)
+		return;
+	free(tmpl->str);
+	free(tmpl->buf);
+	free(tmpl->segs);
+	free(tmpl);
+}
+
+/*
+ * Returns the drive's parameter for the given field code.
+ */
+static const char *
+field_value(const drive_t *drvp, char code, char *numbuf, size_t size)
+{
+	int i;
+
+	switch (code) {
+	case 'd':
+		return (drvp->dev);
+	case 'm':
+		return (drvp->mntpt != NULL ? drvp->mntpt : "");
+	case 'l':
+		return (drvp->volid != NULL ? drvp->volid : "");
+	case 'f':
+		return (drvp->fsname != NULL ? drvp->fsname : "");
+	case 't':
+		for (i = 0; i < NDSKTYPES; i++) {
+			if (disktypetbl[i].type == drvp->type)
+				return (disktypetbl[i].name);
+		}
+		return ("");
+	case 's':
+		(void)snprintf(numbuf, size, "%d", drvp->speed);
+		return (numbuf);
+	}
+	return ("");
+}
+
+/*
+ * Returns the length of the given field value quoted for the shell.
+ */
+static size_t
+quoted_len(const char *val, char quote)
 {
-	char *p;
+	size_t len;
 
-	while ((p = readln(false)) != NULL) {
-		switch (process_event(p)) {
-		case EVENT_SUCCESS_MSG:
-		case EVENT_ERROR_MSG:
-			call_reply_function();
-		}
+	for (len = 0; *val != '\0'; val++) {
+		if (quote != '"' && *val == '\'')
+			len += 4;
+		else if (quote == '"' && strchr("\"\\$`", *val) != NULL)
+			len += 2;
+		else
+			len++;
 	}
-	return (TRUE);
+	return (quote == '\0' ? len + 2 : len);
 }
 
-static void
-catch_child(int signo)
+/*
+ * Copies the field value quoted for the shell to 'p', and returns a
+ * pointer to the end of the copied string. Unquoted fields are put in
+ * single quotes. Within single quotes, a single quote is replaced by
+ * '\'', and within double quotes, ", \, $ and ` are escaped.
+ */
+static char *
+quote_field(char *p, const char *val, char quote)
 {
-	int   i, status;
-	pid_t pid;
+	if (quote == '\0')
+		*p++ = '\'';
+	for (; *val != '\0'; val++) {
+		if (quote != '"' && *val == '\'') {
+			(void)memcpy(p, "'\\''", 4);
+			p += 4;
+			continue;
+		} else if (quote == '"' && strchr("\"\\$`", *val) != NULL)
+			*p++ = '\\';
+		*p++ = *val;
+	}
+	if (quote == '\0')
+		*p++ = '\'';
+	return (p);
+}
 
-	if ((pid = waitpid(-1, &status, WNOHANG)) != -1 && WIFEXITED(status)) {
-		for (i = 0; i < NPROCS; i++) {
-			if (pid == proctbl[i].pid) {
-				proctbl[i].error = WEXITSTATUS(status);
-				if (proctbl[i].error == EXIT_ENOENT ||
-				    proctbl[i].error == EXIT_EXEC_ERR)
-					gtk_main_quit();
-				else {
-					/* Child exited successfully. */
-					free(proctbl[i].cmdstr);
-					proctbl[i].pid = -1;
-				}
-				return;
-			}
+/*
+ * Expands the template with the parameters of the given drive, and
+ * returns a NULL terminated argument vector. The vector and the strings
+ * are allocated in one block, whose exact size is computed first.
+ */
+static char **
+expand_cmdtmpl(const cmdtmpl_t *tmpl, const drive_t *drvp)
+{
+	int		       i, word;
+	char		       *p, **argv, numbuf[16];
+	size_t		       len;
+	const char	       *val;
+	const struct tmplseg_s *seg;
+
+	len = (tmpl->nwords + 1) * sizeof(char *) + tmpl->nwords;
+	for (i = 0; i < tmpl->nsegs; i++) {
+		seg = &tmpl->segs[i];
+		if (seg->code == '\0') {
+			len += seg->len;
+			continue;
+		}
+		val = field_value(drvp, seg->code, numbuf, sizeof(numbuf));
+		len += tmpl->shell ? quoted_len(val, seg->quote) : strlen(val);
+	}
+	if ((argv = malloc(len)) == NULL)
+		xerr(mainwin.win, EXIT_FAILURE, "malloc()");
+	p = (char *)(argv + tmpl->nwords + 1);
+	for (i = 0, word = -1; i < tmpl->nsegs; i++) {
+		seg = &tmpl->segs[i];
+		if (seg->word != word) {
+			if (word >= 0)
+				*p++ = '\0';
+			argv[++word] = p;
+		}
+		if (seg->code == '\0') {
+			(void)memcpy(p, seg->text, seg->len);
+			p += seg->len;
+			continue;
+		}
+		val = field_value(drvp, seg->code, numbuf, sizeof(numbuf));
+		if (tmpl->shell)
+			p = quote_field(p, val, seg->quote);
+		else {
+			(void)memcpy(p, val, strlen(val));
+			p += strlen(val);
 		}
 	}
+	if (word >= 0)
+		*p = '\0';
+	argv[tmpl->nwords] = NULL;
+
+	return (argv);
 }
 
 /*
- * Parses the command string and executes the command with parameters taken
- * from the given drive.
+ * Executes the command template with parameters taken from the given
+ * drive. Templates without shell syntax are spawned directly, so each
+ * word is passed as one argument, regardless of spaces in the parameters.
  */
 static void
-exec_cmd(const char *cmdstr, drive_t *drvp)
+exec_cmd(const cmdtmpl_t *tmpl, drive_t *drvp)
 {
-	int	 i, n, len;
-	char	 *cmdbuf, *p;
-	pid_t	 pid;
-	sigset_t sigmask, savedmask;
-
-	/* try to find a free slot. */
-	for (i = 0; i < NPROCS; i++) {
-		if (proctbl[i].pid == -1)
-			break;
-	}
-	if (i == NPROCS) {
-		xwarnx(mainwin.win, _("Maximal number of processes reached"));
+	int	    error;
+	char	    **argv, **words, *shargv[4];
+	pid_t	    pid;
+	job_t	    *job;
+	const char  *sect;
+	extern char **environ;
+
+	if (tmpl == NULL || tmpl->nwords == 0)
+		return;
+	words = expand_cmdtmpl(tmpl, drvp);
+	if (tmpl->shell) {
+		shargv[0] = _PATH_BSHELL;
+		shargv[1] = "-c";
+		shargv[2] = words[0];
+		shargv[3] = NULL;
+		argv = shargv;
+	} else
+		argv = words;
+	sect = wd_enter("spawn");
+	error = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+	wd_leave(sect);
+	if (error != 0) {
+		errno = error;
+		xwarn(mainwin.win, _("Couldn't execute command \"%s\""),
+		    argv[0]);
+		free(words);
 		return;
 	}
-	if ((cmdbuf = malloc(_POSIX2_LINE_MAX)) == NULL)
+	if ((job = malloc(sizeof(job_t))) == NULL)
 		xerr(mainwin.win, EXIT_FAILURE, "malloc()");
-	for (len = _POSIX2_LINE_MAX, p = cmdbuf; *cmdstr != '\0' && len > 0;) {
-		if (*cmdstr == '%') {
-			switch (*++cmdstr) {
-			case 'd':
-				n = strlen(drvp->dev);
-				if (len - n - 1 < 0) {
-					xwarn(mainwin.win,
-					    _("Command string too long"));
-					goto cleanup;
-				}
-				(void)strncpy(p, drvp->dev, n);
-				len -= n; p += n;
-				break;
-			case 'm':
-				if (drvp->mntpt != NULL)
-					n = strlen(drvp->mntpt);
-				else
-					n = 0;
-				if (len - n - 1 < 0) {
-					xwarn(mainwin.win,
-					    _("Command string too long"));
-					goto cleanup;
-				}
-				if (n > 0) {
-					(void)snprintf(p, n + 1, "%s",
-					    drvp->mntpt);
-				}
-				len -= n; p += n;
-				break;
-			default:
-				xwarnx(mainwin.win,
-				    _("Unknown field code '%%%c'"), *cmdstr);
-				goto cleanup;
-			}
-		} else {
-			*p++ = *cmdstr;
-			len--;
-		}
-		cmdstr++;
-	}
-	*p = '\0';
-
-	if (*cmdstr != '\0') {
-		xwarn(mainwin.win, _("Command string too long"));
-		goto cleanup;
-	}
-	/* Block SIGCHLD */
-	(void)sigemptyset(&sigmask); (void)sigaddset(&sigmask, SIGCHLD);
-	(void)sigprocmask(SIG_BLOCK, &sigmask, &savedmask);
-
-	switch ((pid = vfork())) {
-	case -1:
-		xerr(mainwin.win, EXIT_FAILURE, "vfork()");
-		/* NOTREACHED */
-	case  0:
-		/* Restore old signal mask */
-		(void)sigprocmask(SIG_SETMASK, &savedmask, NULL);
-		execl(_PATH_BSHELL, _PATH_BSHELL, "-c", cmdbuf, NULL);
-		proctbl[i].saved_errno = errno;
-		_exit(255);
-		/* NOTREACHED */
-	default:
-		proctbl[i].pid = pid;
-		if ((proctbl[i].cmdstr = strdup(cmdbuf)) == NULL)
-			xerr(mainwin.win, EXIT_FAILURE, "strdup()");
-		/* Restore old signal mask */
-		(void)sigprocmask(SIG_SETMASK, &savedmask, NULL);
-		break;
-	}
-cleanup:
-	free(cmdbuf);
+	job->pid     = pid;
+	job->status  = 0;
+	job->running = true;
+	job->start   = g_get_monotonic_time();
+	job->cmdstr  = tmpl->shell ? g_strdup(words[0]) :
+	    g_strjoinv(" ", words);
+	if (job->cmdstr == NULL)
+		xerr(mainwin.win, EXIT_FAILURE, "g_strdup()");
+	free(words);
+	record(REC_EXEC, "pid %d: %s", (int)pid, job->cmdstr);
+	DTRACE_PROBE2(dsbmc, exec__spawn, (int)pid, job->cmdstr);
+	g_hash_table_insert(jobs, GINT_TO_POINTER(pid), job);
+	(void)g_child_watch_add(pid, child_exited, job);
+	update_jobs_window();
 }
 
 /*
@@ -1587,40 +4399,30 @@ cleanup:
 static int
 process_event(char *buf)
 {
-	char	*cmd = NULL;
-	drive_t *drvp;
+	gint64				t0;
+	drive_t				*drvp;
+	const struct drvcfg_s	*settings;
 
+	t0 = g_get_monotonic_time();
 	if (parse_dsbmdevent(buf) != 0)
 		return (-1);
+	hist_add(&metrics.parse, g_get_monotonic_time() - t0);
+	metrics.events[dsbmdevent.type & 0x7f]++;
+	DTRACE_PROBE2(dsbmc, event__parse, dsbmdevent.type,
+	    dsbmdevent.drvinfo.dev);
+	record(REC_EVENT, "type=%c dev=%s code=%d command=%s",
+	    dsbmdevent.type, dsbmdevent.drvinfo.dev != NULL ?
+	    dsbmdevent.drvinfo.dev : "-", dsbmdevent.code,
+	    dsbmdevent.command != NULL ? dsbmdevent.command : "-");
 	if (dsbmdevent.type == EVENT_ADD_DEVICE) {
-		if ((drvp = add_drive(&dsbmdevent.drvinfo)) == NULL)
+		if ((drvp = add_drive(&dsbmdevent.drvinfo))->hidden)
 			return (dsbmdevent.type);
 		(void)add_icon(drvp);
 		(void)create_icontbl(mainwin.store);
-		gtk_window_deiconify(GTK_WINDOW(mainwin.win));
-		gtk_widget_show_all(GTK_WIDGET(mainwin.win));
-		switch (drvp->type) {
-		case DSKTYPE_AUDIOCD:
-			if (dsbcfg_getval(cfg, CFG_CDDA_AUTO).boolean)
-				cmd = dsbcfg_getval(cfg, CFG_PLAY_CDDA).string;
-			break;
-		case DSKTYPE_DVD:
-			if (dsbcfg_getval(cfg, CFG_DVD_AUTO).boolean)
-				cmd = dsbcfg_getval(cfg, CFG_PLAY_DVD).string;
-			break;
-		case DSKTYPE_VCD:
-			if (dsbcfg_getval(cfg, CFG_VCD_AUTO).boolean)
-				cmd = dsbcfg_getval(cfg, CFG_PLAY_VCD).string;
-			break;
-		case DSKTYPE_SVCD:
-			if (dsbcfg_getval(cfg, CFG_SVCD_AUTO).boolean)
-				cmd = dsbcfg_getval(cfg, CFG_PLAY_SVCD).string;
-			break;
-		default:
-			cmd = NULL;
-		}
-		if (cmd != NULL && *cmd != '\0')
-			exec_cmd(cmd, drvp);
+		show_mainwin();
+		settings = drive_settings(drvp);
+		if (settings->autoplay)
+			exec_cmd(settings->play, drvp);
 	} else if (dsbmdevent.type == EVENT_DEL_DEVICE) {
 		del_icon(dsbmdevent.drvinfo.dev);
 		del_drive(dsbmdevent.drvinfo.dev);
@@ -1651,44 +4453,202 @@ process_event(char *buf)
 }
 
 /*
- * Adds a mount point to the ~/.gtk-bookmarks file.
+ * Returns a pointer to the path of the given bookmark line.
+ */
+static const char *
+bookmark_path(const char *ln)
+{
+	while (isspace(*ln))
+		ln++;
+	if (strncmp(ln, "file://", 7) == 0)
+		ln += 7;
+	return (ln);
+}
+
+/*
+ * Sets up the bookmark store on first use. The file is read once, and
+ * reread if another program changes it.
  */
 static void
-add_bookmark(const char *bookmark)
+init_bookmarks()
 {
-	bool	      found;
-	char	      *path, *ln;
-	FILE	      *fp;
+	GFile	      *file;
+	const char    *sect;
 	struct passwd *pw;
 
+	if (bookmarks.path != NULL)
+		return;
+	sect = wd_enter("bookmarks init");
 	if ((pw = getpwuid(getuid())) == NULL) {
 		xerrx(mainwin.win, EXIT_FAILURE,
 		    _("Couldn't find you in the password file."));
 	}
+	bookmarks.path = g_strdup_printf("%s/%s", pw->pw_dir, PATH_BOOKMARK);
+	if (bookmarks.path == NULL)
+		xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
 	endpwent();
+	bookmarks.lines   = g_queue_new();
+	bookmarks.pending = g_queue_new();
+	bookmarks.set	  = g_hash_table_new(g_str_hash, g_str_equal);
+	read_bookmarks();
+
+	file = g_file_new_for_path(bookmarks.path);
+	bookmarks.monitor = g_file_monitor_file(file, G_FILE_MONITOR_NONE,
+	    NULL, NULL);
+	g_object_unref(file);
+	if (bookmarks.monitor != NULL) {
+		g_signal_connect(G_OBJECT(bookmarks.monitor), "changed",
+		    G_CALLBACK(bookmarks_file_changed), NULL);
+	}
+	wd_leave(sect);
+}
+
+/*
+ * (Re)reads the bookmarks file into the store.
+ */
+static void
+read_bookmarks()
+{
+	char *ln, *p;
+	FILE *fp;
+
+	g_hash_table_remove_all(bookmarks.set);
+	while ((p = g_queue_pop_head(bookmarks.lines)) != NULL)
+		g_free(p);
+	(void)memset(&bookmarks.sb, 0, sizeof(bookmarks.sb));
+	if ((fp = fopen(bookmarks.path, "r")) == NULL) {
+		if (errno != ENOENT) {
+			xwarn(mainwin.win, _("Couldn't open \"%s\""),
+			    bookmarks.path);
+		}
+		return;
+	}
+	(void)fstat(fileno(fp), &bookmarks.sb);
 	if ((ln = malloc(_POSIX2_LINE_MAX)) == NULL)
 		xerr(mainwin.win, EXIT_FAILURE, "malloc()");
-	path = g_strdup_printf("%s/%s", pw->pw_dir, PATH_BOOKMARK);
-	if (path == NULL)
-		xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
-	if ((fp = fopen(path, "r+")) == NULL && errno == ENOENT) {
-		if ((fp = fopen(path, "w+")) == NULL)
-			xerr(mainwin.win, EXIT_FAILURE, "fopen(%s)", path);
-	} else if (fp == NULL)
-		xerr(mainwin.win, EXIT_FAILURE, "fopen(%s)", path);
-	if (flock(fileno(fp), LOCK_EX) == -1)
-		xerr(mainwin.win, EXIT_FAILURE, "flock()");
-	for (found = false; fgets(ln, _POSIX2_LINE_MAX, fp) != NULL;) {
-		(void)strtok(ln, "\n\r");
-		if (strcmp(ln, bookmark) == 0 ||
-		    strcmp(ln + strlen("file://"), bookmark) == 0)
-			found = true;
-	}
-	if (!found)
-		(void)fprintf(fp, "file://%s\n", bookmark);
+	while (fgets(ln, _POSIX2_LINE_MAX, fp) != NULL) {
+		ln[strcspn(ln, "\n\r")] = '\0';
+		if ((p = g_strdup(ln)) == NULL)
+			xerr(mainwin.win, EXIT_FAILURE, "g_strdup()");
+		g_queue_push_tail(bookmarks.lines, p);
+		if (*bookmark_path(p) != '\0' &&
+		    g_hash_table_lookup(bookmarks.set, bookmark_path(p)) == NULL)
+			g_hash_table_insert(bookmarks.set,
+			    (gpointer)bookmark_path(p), p);
+	}
 	(void)fclose(fp);
 	free(ln);
-	g_free(path);
+}
+
+/*
+ * Returns true if the bookmarks file was changed since we read or wrote
+ * it the last time.
+ */
+static bool
+bookmarks_changed_on_disk()
+{
+	struct stat sb;
+
+	if (stat(bookmarks.path, &sb) == -1)
+		return (bookmarks.sb.st_ino != 0);
+	return (sb.st_ino != bookmarks.sb.st_ino ||
+	    sb.st_size != bookmarks.sb.st_size ||
+	    sb.st_mtime != bookmarks.sb.st_mtime);
+}
+
+/*
+ * Rereads the bookmarks file, and reapplies the changes not yet written.
+ */
+static void
+reload_bookmarks()
+{
+	GList *l;
+
+	read_bookmarks();
+	for (l = bookmarks.pending->head; l != NULL; l = l->next) {
+		apply_bookmark(*(char *)l->data == '+',
+		    (char *)l->data + 1);
+	}
+}
+
+static void
+bookmarks_file_changed(GFileMonitor *monitor, GFile *file, GFile *other,
+	GFileMonitorEvent event, gpointer unused)
+{
+	const char *sect;
+
+	if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+	    event != G_FILE_MONITOR_EVENT_CREATED &&
+	    event != G_FILE_MONITOR_EVENT_DELETED)
+		return;
+	sect = wd_enter("bookmarks read");
+	/* Ignore the events caused by our own writes. */
+	if (bookmarks_changed_on_disk())
+		reload_bookmarks();
+	wd_leave(sect);
+}
+
+/*
+ * Adds the given path to, or deletes it from the in-memory bookmarks.
+ */
+static void
+apply_bookmark(bool add, const char *bookmark)
+{
+	char  *ln;
+	GList *l, *next;
+
+	if (add) {
+		if (g_hash_table_lookup(bookmarks.set, bookmark) != NULL)
+			return;
+		if ((ln = g_strdup_printf("file://%s", bookmark)) == NULL)
+			xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
+		g_queue_push_tail(bookmarks.lines, ln);
+		g_hash_table_insert(bookmarks.set,
+		    (gpointer)bookmark_path(ln), ln);
+		return;
+	}
+	if (g_hash_table_lookup(bookmarks.set, bookmark) == NULL)
+		return;
+	(void)g_hash_table_remove(bookmarks.set, bookmark);
+	/* Delete all matching lines. */
+	for (l = bookmarks.lines->head; l != NULL; l = next) {
+		next = l->next;
+		if (strcmp(bookmark_path(l->data), bookmark) == 0) {
+			g_free(l->data);
+			g_queue_delete_link(bookmarks.lines, l);
+		}
+	}
+}
+
+/*
+ * Records a change to the bookmarks, and schedules writing them back.
+ */
+static void
+change_bookmark(bool add, const char *bookmark)
+{
+	char *op;
+
+	init_bookmarks();
+	if ((g_hash_table_lookup(bookmarks.set, bookmark) != NULL) == add)
+		return;
+	op = g_strdup_printf("%c%s", add ? '+' : '-', bookmark);
+	if (op == NULL)
+		xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
+	g_queue_push_tail(bookmarks.pending, op);
+	apply_bookmark(add, bookmark);
+	if (bookmarks.timer == 0) {
+		bookmarks.timer = g_timeout_add(BOOKMARK_FLUSH_DELAY,
+		    flush_bookmarks_timeout, NULL);
+	}
+}
+
+/*
+ * Adds a mount point to the ~/.gtk-bookmarks file.
+ */
+static void
+add_bookmark(const char *bookmark)
+{
+	change_bookmark(true, bookmark);
 }
 
 /*
@@ -1697,73 +4657,92 @@ add_bookmark(const char *bookmark)
 static void
 del_bookmark(const char *bookmark)
 {
-	char	      *path_from, *path_to, *buf, *p;
-	FILE	      *fp_from, *fp_to;
-	struct passwd *pw;
-	
-	if ((pw = getpwuid(getuid())) == NULL) {
-		xerrx(mainwin.win, EXIT_FAILURE,
-		    _("Couldn't find you in the password file."));
+	change_bookmark(false, bookmark);
+}
+
+static gboolean
+flush_bookmarks_timeout(gpointer unused)
+{
+	const char *sect;
+
+	bookmarks.timer = 0;
+	sect = wd_enter("bookmarks write");
+	flush_bookmarks();
+	wd_leave(sect);
+
+	return (FALSE);
+}
+
+/*
+ * Writes pending bookmark changes to a temporary file, and renames it to
+ * ~/.gtk-bookmarks.
+ */
+static void
+flush_bookmarks()
+{
+	int   fd;
+	char  *p, *tmpath;
+	FILE  *fp;
+	GList *l;
+
+	if (bookmarks.timer > 0) {
+		(void)g_source_remove(bookmarks.timer);
+		bookmarks.timer = 0;
 	}
-	endpwent();
-	path_from = g_strdup_printf("%s/%s", pw->pw_dir, PATH_BOOKMARK);
-	if (path_from == NULL)
-		xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
-	if ((fp_from = fopen(path_from, "r")) == NULL) {
-		xwarn(mainwin.win, _("Couldn't open \"%s\""), path_from);
-		g_free(path_from);
+	if (bookmarks.pending == NULL || g_queue_is_empty(bookmarks.pending))
 		return;
-	}
-	path_to = g_strdup_printf("%s/%s.%d", pw->pw_dir, PATH_BOOKMARK,
-	    getpid());
-	if (path_to == NULL)
+	/* Don't overwrite changes made by another program. */
+	if (bookmarks_changed_on_disk())
+		reload_bookmarks();
+	if ((tmpath = g_strdup_printf("%s.XXXXXX", bookmarks.path)) == NULL)
 		xerr(mainwin.win, EXIT_FAILURE, "g_strdup_printf()");
-	if ((fp_to = fopen(path_to, "w+")) == NULL) {
-		xwarn(mainwin.win, _("Couldn't create \"%s\""), path_to);
-		g_free(path_from); g_free(path_to);
-		(void)fclose(fp_from);
+	fp = NULL;
+	if ((fd = mkstemp(tmpath)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		xwarn(mainwin.win, _("Couldn't create \"%s\""), tmpath);
+		if (fd != -1) {
+			(void)close(fd); (void)unlink(tmpath);
+		}
+		g_free(tmpath);
 		return;
 	}
-	if (flock(fileno(fp_from), LOCK_EX) == -1) {
-		xwarn(mainwin.win, "flock()");
-		(void)fclose(fp_from); (void)fclose(fp_to);
-		g_free(path_from); g_free(path_to); 
+	if (bookmarks.sb.st_ino != 0)
+		(void)fchmod(fd, bookmarks.sb.st_mode & 07777);
+	for (l = bookmarks.lines->head; l != NULL; l = l->next)
+		(void)fprintf(fp, "%s\n", (char *)l->data);
+	if (fclose(fp) != 0 || rename(tmpath, bookmarks.path) == -1) {
+		xwarn(mainwin.win, _("Couldn't write \"%s\""),
+		    bookmarks.path);
+		(void)unlink(tmpath);
+		g_free(tmpath);
 		return;
 	}
-	if ((buf = malloc(_POSIX2_LINE_MAX)) == NULL)
-		xerr(mainwin.win, EXIT_FAILURE, "malloc()");
-	while ((p = fgets(buf, _POSIX2_LINE_MAX, fp_from)) != NULL) {
-		(void)strtok(buf, "\n\r");
-		while (isspace(*p))
-			p++;
-		if (*p == '\0')
-			continue;
-		if (strncmp(p, "file://", 7) == 0)
-			p += 7;
-		if (strcmp(p, bookmark) != 0)
-			(void)fprintf(fp_to, "%s\n", buf);
-	}
-	if (rename(path_to, path_from) == -1)
-		warn("rename(%s, %s)", path_to, path_from);
-	g_free(path_from); g_free(path_to);
-	(void)fclose(fp_to);
-	(void)fclose(fp_from);
-	free(buf);
+	g_free(tmpath);
+	(void)stat(bookmarks.path, &bookmarks.sb);
+	while ((p = g_queue_pop_head(bookmarks.pending)) != NULL)
+		g_free(p);
 }
 
 static void
 call_reply_function()
 {
-	/* Call reply function of last executed command. */
-	cmdq[cmdqidx].re(cmdq[cmdqidx].icon);
+	gint64		   t0;
+	const char	   *sect;
+	struct cmdmetric_s *mp;
 
-	if (++cmdqidx == cmdqlen) {
-		/* Queue completely processed. */
-		cmdqlen = cmdqidx = 0;
-	} else {
-		/* Execute next command in queue. */
-		(void)fputs(cmdq[cmdqidx].cmd, sock);
-	}
+	if (late_reply() || cmdsched.cur == NULL)
+		return;
+	mp = &metrics.cmd[cmdsched.cur->metric];
+	t0 = g_get_monotonic_time();
+	hist_add(&mp->rtt, t0 - cmdsched.cur->sent);
+	DTRACE_PROBE3(dsbmc, reply__start, mp->name, dsbmdevent.type,
+	    dsbmdevent.code);
+	/* Call reply function of last executed command. */
+	sect = wd_enter(mp->name);
+	cmdsched.cur->re(cmdsched.cur->icon);
+	wd_leave(sect);
+	hist_add(&mp->handler, g_get_monotonic_time() - t0);
+	DTRACE_PROBE1(dsbmc, reply__done, mp->name);
+	finish_cmd();
 }
 
 static void
@@ -1772,8 +4751,9 @@ cb_mount(GtkWidget *widget, gpointer data)
 	icon_t *icon;
 
 	icon = (icon_t *)data;
-	sndcmd(process_mount_reply, icon, "mount %s\n", icon->drvp->dev);
-	busywin(BUSYWIN_MSG, true);
+	if (sndcmd(process_mount_reply, icon, "mount %s\n",
+	    icon->drvp->dev) == 0)
+		set_busy(icon, true);
 }
 
 static void
@@ -1781,7 +4761,7 @@ process_mount_reply(icon_t *icon)
 {
 	const char *msg;
 
-	busywin(NULL, false);
+	set_busy(icon, false);
 	switch (dsbmdevent.type) {
 	case EVENT_SUCCESS_MSG:
 		icon->drvp->mounted = true;
@@ -1810,12 +4790,16 @@ process_mount_reply(icon_t *icon)
 }
 
 static void
-cb_cb(GtkWidget *cb, gpointer bp)
+cb_cb(GtkWidget *cb, gpointer var)
 {
-	if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(cb)))
-		*(bool *)bp = true;
-	else
-		*(bool *)bp = false;
+	bool active, changed[CFG_NVARS];
+
+	active = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(cb));
+	(void)memset(changed, 0, sizeof(changed));
+	changed[GPOINTER_TO_INT(var)] = true;
+	(void)dsbcfg_setval(cfg, GPOINTER_TO_INT(var), DSBCFG_VAL(active));
+	notify_cfg_changed(changed);
+	schedule_cfg_flush();
 }
 
 static void
@@ -1824,8 +4808,9 @@ cb_unmount(GtkWidget *widget, gpointer data)
 	icon_t *icon;
 
 	icon = (icon_t *)data;
-	sndcmd(process_unmount_reply, icon, "unmount %s\n", icon->drvp->dev);
-	busywin(BUSYWIN_MSG, true);
+	if (sndcmd(process_unmount_reply, icon, "unmount %s\n",
+	    icon->drvp->dev) == 0)
+		set_busy(icon, true);
 }
 
 static void
@@ -1833,7 +4818,7 @@ process_unmount_reply(icon_t *icon)
 {
 	const char *msg;
 
-	busywin(NULL, false);
+	set_busy(icon, false);
 	switch (dsbmdevent.type) {
 	case EVENT_SUCCESS_MSG:
 		icon->drvp->mounted = false;
@@ -1845,11 +4830,13 @@ process_unmount_reply(icon_t *icon)
 	case EVENT_ERROR_MSG:
 		if (dsbmdevent.code == ERR_DEVICE_BUSY ||
 		    dsbmdevent.code == EBUSY) {
-			if (yesnobox(mainwin.win,  _(UNMOUNT_BUSY_MSG)) == 1) {
-				sndcmd(process_unmount_reply, icon,
-				    "unmount -f %s\n", icon->drvp->dev);
-				busywin(BUSYWIN_MSG, true);
-			}
+			/*
+			 * Don't wait for the answer here. We are in the
+			 * middle of processing the command queue.
+			 */
+			yesnobox_async(mainwin.win, force_unmount_answer,
+			    g_strdup(icon->drvp->dev), "%s",
+			    _(UNMOUNT_BUSY_MSG));
 			return;
 		} else if (dsbmdevent.code < 255) {
 			errno = dsbmdevent.code;
@@ -1876,21 +4863,19 @@ process_unmount_reply(icon_t *icon)
 static void
 cb_open(GtkWidget *widget, gpointer data)
 {
-	icon_t *icon;
+	icon_t	  *icon;
+	cmdtmpl_t *fm;
 
-	if (dsbcfg_getval(cfg, CFG_FILEMANAGER).string == NULL ||
-	    !*dsbcfg_getval(cfg, CFG_FILEMANAGER).string)
-		return;
 	icon = (icon_t *)data;
+	fm = drive_settings(icon->drvp)->fm;
+	if (fm == NULL || fm->nwords == 0)
+		return;
 	if (!icon->drvp->mounted) {
-		sndcmd(process_open_reply, icon, "mount %s\n",
-		    icon->drvp->dev);
-		busywin(NULL, false);
-		busywin(BUSYWIN_MSG, true);
-	} else if (dsbcfg_getval(cfg, CFG_FILEMANAGER).string != NULL) {
-		exec_cmd(dsbcfg_getval(cfg, CFG_FILEMANAGER).string,
-		    icon->drvp);
-	}
+		if (sndcmd(process_open_reply, icon, "mount %s\n",
+		    icon->drvp->dev) == 0)
+			set_busy(icon, true);
+	} else
+		exec_cmd(fm, icon->drvp);
 }
 
 static void
@@ -1898,7 +4883,7 @@ process_open_reply(icon_t *icon)
 {
 	const char *msg;
 
-	busywin(NULL, false);
+	set_busy(icon, false);
 	switch (dsbmdevent.type) {
 	case EVENT_SUCCESS_MSG:
 		icon->drvp->mounted = true;
@@ -1909,10 +4894,7 @@ process_open_reply(icon_t *icon)
 		set_mounted(icon, true);
 		add_bookmark(icon->drvp->mntpt);
 		cb_size(NULL, icon);
-		if (dsbcfg_getval(cfg, CFG_FILEMANAGER).string == NULL)
-			return;
-		exec_cmd(dsbcfg_getval(cfg, CFG_FILEMANAGER).string,
-		    icon->drvp);
+		exec_cmd(drive_settings(icon->drvp)->fm, icon->drvp);
 		return;
 	case EVENT_ERROR_MSG:
 		if (dsbmdevent.code < 255) {
@@ -1976,7 +4958,10 @@ process_size_reply(icon_t *icon)
 		str = g_strdup_printf(
 		    _(" %s\tDisk size: %.1f %s\tFree: %.1f %s"),
 		     icon->drvp->dev, ms, u_ms, fs, u_fs);
-		gtk_statusbar_push(GTK_STATUSBAR(mainwin.statusbar), 0, str);
+		if (mainwin.statusbar != NULL) {
+			gtk_statusbar_push(GTK_STATUSBAR(mainwin.statusbar),
+			    0, str);
+		}
 		g_free(str);
 	}
 }
@@ -1984,8 +4969,10 @@ process_size_reply(icon_t *icon)
 static void
 cb_speed(GtkWidget *widget, gpointer data)
 {
+	int	      response;
 	icon_t	      *icon;
 	GtkWidget     *win, *label, *spin, *ok, *cancel;
+	const char    *sect;
 	static int    speed = 0;
 	GtkAdjustment *adj;
 
@@ -2012,15 +4999,18 @@ cb_speed(GtkWidget *widget, gpointer data)
 	    GTK_RESPONSE_REJECT);
 	gtk_widget_show_all(win);
 
-	if (gtk_dialog_run(GTK_DIALOG(win)) != GTK_RESPONSE_ACCEPT) {
+	sect = wd_enter("speed dialog");
+	response = gtk_dialog_run(GTK_DIALOG(win));
+	wd_leave(sect);
+	if (response != GTK_RESPONSE_ACCEPT) {
 		gtk_widget_destroy(win);
 		return;
 	}
 	speed = (int)gtk_adjustment_get_value(GTK_ADJUSTMENT(adj));
-	sndcmd(process_speed_reply, icon, "speed %s %d\n",
-	    icon->drvp->dev, speed);
 	gtk_widget_destroy(win);
-	busywin(BUSYWIN_MSG, true);
+	if (sndcmd(process_speed_reply, icon, "speed %s %d\n",
+	    icon->drvp->dev, speed) == 0)
+		set_busy(icon, true);
 }
 
 static void
@@ -2028,7 +5018,7 @@ process_speed_reply(icon_t *icon)
 {
 	const char *msg;
 
-	busywin(NULL, false);
+	set_busy(icon, false);
 	switch (dsbmdevent.type) {
 	case EVENT_ERROR_MSG:
 		if (dsbmdevent.code < 255) {
@@ -2057,8 +5047,9 @@ cb_eject(GtkWidget *widget, gpointer data)
 
 	icon = (icon_t *)data;
 
-	sndcmd(process_eject_reply, icon, "eject %s\n", icon->drvp->dev);
-	busywin(BUSYWIN_MSG, true);
+	if (sndcmd(process_eject_reply, icon, "eject %s\n",
+	    icon->drvp->dev) == 0)
+		set_busy(icon, true);
 }
 
 static void
@@ -2066,17 +5057,15 @@ process_eject_reply(icon_t *icon)
 {
 	const char *msg;
 
-	busywin(NULL, false);
+	set_busy(icon, false);
 	switch (dsbmdevent.type) {
 	case EVENT_ERROR_MSG:
 		if (dsbmdevent.code == ERR_DEVICE_BUSY ||
 		    dsbmdevent.code == EBUSY) {
-			if (yesnobox(mainwin.win, _(EJECT_BUSY_MSG)) == 1) {
-				sndcmd(process_eject_reply, icon,
-				    "eject -f %s\n", icon->drvp->dev);
-				busywin(BUSYWIN_MSG, true);
-			} else
-				return;
+			yesnobox_async(mainwin.win, force_eject_answer,
+			    g_strdup(icon->drvp->dev), "%s",
+			    _(EJECT_BUSY_MSG));
+			return;
 		} else if (dsbmdevent.code < 255) {
 			errno = dsbmdevent.code;
 			xwarn(mainwin.win, _("Ejecting failed with the " \
@@ -2099,50 +5088,84 @@ process_eject_reply(icon_t *icon)
 	}
 }
 
+/*
+ * Drops the icon's commands from the queue. A command already sent to
+ * DSBMD still runs, but we don't wait for its reply anymore.
+ */
+static void
+cb_cancel(GtkWidget *widget, gpointer data)
+{
+	cancel_cmds((icon_t *)data);
+}
+
+static void
+force_unmount_answer(int answer, gpointer dev)
+{
+	send_forced_cmd(answer, dev, process_unmount_reply, "unmount -f");
+}
+
+static void
+force_eject_answer(int answer, gpointer dev)
+{
+	send_forced_cmd(answer, dev, process_eject_reply, "eject -f");
+}
+
+/*
+ * Called when the user answered the question whether to force unmounting
+ * or ejecting. The device is looked up again by name, because it may have
+ * been removed while the dialog was open.
+ */
+static void
+send_forced_cmd(int answer, char *dev, void (*re)(icon_t *), const char *cmd)
+{
+	icon_t *icon;
+
+	if (answer == 1 && (icon = lookup_icon(dev)) != NULL) {
+		if (sndcmd(re, icon, "%s %s\n", cmd, icon->drvp->dev) == 0)
+			set_busy(icon, true);
+	}
+	g_free(dev);
+}
+
 static void
 cb_play(GtkWidget *widget, gpointer data)
 {
-	char   *cmd;
 	icon_t *icon;
 
 	icon = (icon_t *)data;
-
-	switch (icon->drvp->type) {
-	case DSKTYPE_AUDIOCD:
-		cmd = dsbcfg_getval(cfg, CFG_PLAY_CDDA).string;
-		break;
-	case DSKTYPE_DVD:
-		cmd = dsbcfg_getval(cfg, CFG_PLAY_DVD).string;
-		break;
-	case DSKTYPE_VCD:
-		cmd = dsbcfg_getval(cfg, CFG_PLAY_VCD).string;
-		break;
-	case DSKTYPE_SVCD:
-		cmd = dsbcfg_getval(cfg, CFG_PLAY_SVCD).string;
-		break;
-	default:
-		return;
-	}
-	if (cmd == NULL || *cmd == '\0')
-		return;
-	exec_cmd(cmd, icon->drvp);
+	exec_cmd(drive_settings(icon->drvp)->play, icon->drvp);
 }
 
-static drive_t *
-add_drive(drive_t *drvp)
+/*
+ * Returns true if the drive's device or mount point is in the ignore list.
+ * While the config is being loaded at startup, no drive is hidden. The
+ * drives are checked again after the config is available.
+ */
+static bool
+drive_hidden(const drive_t *drvp)
 {
-	bool hide;
 	char **v;
 
-	for (hide = false, v = dsbcfg_getval(cfg, CFG_HIDE).strings;
-	    !hide && v != NULL && *v != NULL; v++) {
+	if (cfg == NULL)
+		return (false);
+	for (v = dsbcfg_getval(cfg, CFG_HIDE).strings; v != NULL && *v != NULL;
+	    v++) {
 		if (strcmp(drvp->dev, *v) == 0)
-			hide = true;
+			return (true);
 		else if (drvp->mntpt != NULL && strcmp(drvp->mntpt, *v) == 0)
-			hide = true;
+			return (true);
 	}
-	if (hide)
-		return (NULL);
+	return (false);
+}
+
+/*
+ * Adds the drive to the list of drives. Drives in the ignore list are
+ * kept, but marked hidden, so that they can be shown again if the list
+ * changes.
+ */
+static drive_t *
+add_drive(drive_t *drvp)
+{
 	drives = realloc(drives, (ndrives + 1) * sizeof(drive_t *));
 	if (drives == NULL || drvp->dev == NULL)
 		err(EXIT_FAILURE, "realloc()");
@@ -2163,6 +5186,8 @@ add_drive(drive_t *drvp)
 	drives[ndrives]->speed = drvp->speed;
 	drives[ndrives]->type  = drvp->type;
 	drives[ndrives]->cmds  = drvp->cmds;
+	drives[ndrives]->settings.gen = 0;
+	drives[ndrives]->hidden = drive_hidden(drvp);
 
 	/* Add our own commands to the device's command list, and set VolIDs. */
 	switch (drvp->type) {
@@ -2190,6 +5215,79 @@ add_drive(drive_t *drvp)
 	return (drives[ndrives++]);
 }
 
+/*
+ * Returns the settings of the given drive. They are resolved from the
+ * drive's config section, and the global section on first use, and
+ * cached until the config changes.
+ *
+ * A section labeled with a volume ID or a device name, e.g.
+ *
+ *	/dev/da0s1:
+ *	filemanager = "thunar %m"
+ *	dvd_auto = false
+ *
+ * overrides the global filemanager, play_* and *_auto settings for that
+ * device. The volume ID takes precedence over the device name.
+ */
+static const struct drvcfg_s *
+drive_settings(drive_t *drvp)
+{
+	int	  play, autoplay;
+	dsbcfg_t  *sect;
+	cmdtmpl_t **tmpls;
+
+	if (drvp->settings.gen == cfggen)
+		return (&drvp->settings);
+	if ((sect = dsbcfg_getnode(cfg, drvp->volid)) == NULL)
+		sect = dsbcfg_getnode(cfg, drvp->dev);
+	tmpls = sect != NULL ? g_hash_table_lookup(sectmpls, sect->label) : NULL;
+	switch (drvp->type) {
+	case DSKTYPE_AUDIOCD:
+		play = CFG_PLAY_CDDA; autoplay = CFG_CDDA_AUTO;
+		break;
+	case DSKTYPE_DVD:
+		play = CFG_PLAY_DVD; autoplay = CFG_DVD_AUTO;
+		break;
+	case DSKTYPE_VCD:
+		play = CFG_PLAY_VCD; autoplay = CFG_VCD_AUTO;
+		break;
+	case DSKTYPE_SVCD:
+		play = CFG_PLAY_SVCD; autoplay = CFG_SVCD_AUTO;
+		break;
+	default:
+		play = autoplay = -1;
+	}
+	drvp->settings.fm = drive_cmdtmpl(sect, tmpls, CFG_FILEMANAGER);
+	if (play != -1) {
+		drvp->settings.play = drive_cmdtmpl(sect, tmpls, play);
+		if (sect != NULL && dsbcfg_isset(sect, autoplay)) {
+			drvp->settings.autoplay =
+			    dsbcfg_getval(sect, autoplay).boolean;
+		} else {
+			drvp->settings.autoplay =
+			    dsbcfg_getval(cfg, autoplay).boolean;
+		}
+	} else {
+		drvp->settings.play	= NULL;
+		drvp->settings.autoplay = false;
+	}
+	drvp->settings.gen = cfggen;
+
+	return (&drvp->settings);
+}
+
+/*
+ * Returns the device section's template for the given variable if the
+ * section sets it, else the global one.
+ */
+static cmdtmpl_t *
+drive_cmdtmpl(dsbcfg_t *sect, cmdtmpl_t **tmpls, int var)
+{
+	if (sect != NULL && tmpls != NULL && dsbcfg_isset(sect, var))
+		return (tmpls[var]);
+	return (cmdtmpls[var]);
+}
+
 static void
 del_drive(const char *dev)
 {
@@ -2214,14 +5312,14 @@ static int
 parse_dsbmdevent(char *str)
 {
 	int  i, len;
-	char *p, *q, *tmp;
+	char *p, *q, *tmp, *last, *qlast;
 
 	/* Init */
 	for (i = 0; i < NKEYWORDS; i++) {
 		if (dsbmdkeywords[i].val.string != NULL)
 			*dsbmdkeywords[i].val.string = NULL;
 	}
-	for (p = str; (p = strtok(p, ":\n")) != NULL; p = NULL) {
+	for (p = str; (p = strtok_r(p, ":\n", &last)) != NULL; p = NULL) {
 		for (i = 0; i < NKEYWORDS; i++) {
 			len = strlen(dsbmdkeywords[i].key);
 			if (strncmp(dsbmdkeywords[i].key, p, len) == 0)
@@ -2229,6 +5327,7 @@ parse_dsbmdevent(char *str)
 		}
 		if (i == NKEYWORDS) {
 			warnx("Unknown keyword '%s'", p);
+			record(REC_WARN, "Unknown keyword '%s'", p);
 			continue;
 		}
 		switch (dsbmdkeywords[i].type) {
@@ -2250,7 +5349,8 @@ parse_dsbmdevent(char *str)
 			dsbmdevent.drvinfo.cmds = 0;
 			if ((q = tmp = strdup(p + len)) == NULL)
 				xerr(NULL, EXIT_FAILURE, "strdup()");
-			for (i = 0; (q = strtok(q, ",")) != NULL; q = NULL) {
+			for (; (q = strtok_r(q, ",", &qlast)) != NULL;
+			    q = NULL) {
 				for (i = 0; i < NCMDS; i++) {
 					if (strcmp(cmdtbl[i].name, q) == 0) {
 						dsbmdevent.drvinfo.cmds |=
@@ -2277,8 +5377,9 @@ parse_dsbmdevent(char *str)
 static int
 create_mddev(const char *image)
 {
-	int  i;
-	char *path, *cmd, *p;
+	int	   i;
+	char	   *path, *cmd, *p;
+	gint64	   t0;
 	const char *errstr;
 
 	if (sock == NULL) {
@@ -2311,6 +5412,8 @@ create_mddev(const char *image)
 	if ((cmd = malloc(strlen(path) + strlen("mdattach ") + 8)) == NULL)
 		xerr(NULL, EXIT_FAILURE, "malloc()");
 	(void)sprintf(cmd, "mdattach \"%s\"\n", path);
+	record(REC_CMD, "%s", cmd);
+	t0 = g_get_monotonic_time();
 	errno = 0;
 	while (fputs(cmd, sock) == EOF) {
 		if (errno == EINTR)
@@ -2322,6 +5425,11 @@ create_mddev(const char *image)
 	while ((p = readln(true)) != NULL) {
 		if (parse_dsbmdevent(p) != 0)
 			continue;
+		if (dsbmdevent.type == EVENT_ERROR_MSG ||
+		    dsbmdevent.type == EVENT_SUCCESS_MSG) {
+			hist_add(&metrics.cmd[MET_MDATTACH].rtt,
+			    g_get_monotonic_time() - t0);
+		}
 		if (dsbmdevent.type == EVENT_ERROR_MSG) {
 			errstr = errmsg(dsbmdevent.code);
 			xwarnx(NULL, "Couldn't create memory disk from " \
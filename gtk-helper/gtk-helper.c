@@ -23,6 +23,7 @@
  */
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <err.h>
@@ -70,16 +71,41 @@ load_icon(int size, const char *name, ...)
 	return (NULL);
 }
 
+static void (*xerr_hook)(void);
+
+/*
+ * Sets a function which xerr() and xerrx() call before they show the
+ * error and exit.
+ */
+void
+set_xerr_hook(void (*hook)(void))
+{
+	xerr_hook = hook;
+}
+
+/*
+ * Shows a message box. If 'wait' is false, the function returns at once,
+ * and the box destroys itself when it is closed. This is what xwarn() and
+ * xwarnx() use, so a warning never runs a nested main loop.
+ */
 static void
-infobox(GtkWindow *parent, const char *str, const GtkMessageType type)
+infobox(GtkWindow *parent, const char *str, const GtkMessageType type,
+	bool wait)
 {
 	GtkWidget    *dialog;
 
 	dialog = gtk_message_dialog_new(parent,
                     GTK_DIALOG_DESTROY_WITH_PARENT, type,
                     GTK_BUTTONS_OK, "%s", str);
-	gtk_dialog_run(GTK_DIALOG(dialog));
-	gtk_widget_destroy(dialog);
+	if (wait) {
+		gtk_dialog_run(GTK_DIALOG(dialog));
+		gtk_widget_destroy(dialog);
+		return;
+	}
+	gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
+	g_signal_connect_swapped(G_OBJECT(dialog), "response",
+	    G_CALLBACK(gtk_widget_destroy), dialog);
+	gtk_widget_show(dialog);
 }
 
 void
@@ -104,7 +130,9 @@ xerr(GtkWindow *parent, int eval, const char *fmt, ...)
 	if (p == NULL)
 		p = strerror(_errno);
 	(void)snprintf(msgbuf + len, rem, ":\n%s\n", p);
-	infobox(parent, msgbuf, GTK_MESSAGE_ERROR);
+	if (xerr_hook != NULL)
+		xerr_hook();
+	infobox(parent, msgbuf, GTK_MESSAGE_ERROR, true);
 	exit(eval);
 }
 
@@ -116,7 +144,9 @@ xerrx(GtkWindow *parent, int eval, const char *fmt, ...)
 	msgbuf[0] = '\0';
 	va_start(ap, fmt);
 	(void)vsnprintf(msgbuf, sizeof(msgbuf), fmt, ap);
-	infobox(parent, msgbuf, GTK_MESSAGE_ERROR);
+	if (xerr_hook != NULL)
+		xerr_hook();
+	infobox(parent, msgbuf, GTK_MESSAGE_ERROR, true);
 	exit(eval);
 }
 
@@ -140,7 +170,7 @@ xwarn(GtkWindow *parent, const char *fmt, ...)
 	if (p == NULL)
 		p = strerror(_errno);
 	(void)snprintf(msgbuf + len, rem, ":\n%s\n", p);
-	infobox(parent, msgbuf, GTK_MESSAGE_ERROR);
+	infobox(parent, msgbuf, GTK_MESSAGE_ERROR, false);
 }
 
 void
@@ -151,7 +181,7 @@ xwarnx(GtkWindow *parent, const char *fmt, ...)
 	msgbuf[0] = '\0';
 	va_start(ap, fmt);
 	(void)vsnprintf(msgbuf, sizeof(msgbuf), fmt, ap);
-	infobox(parent, msgbuf, GTK_MESSAGE_WARNING);
+	infobox(parent, msgbuf, GTK_MESSAGE_WARNING, false);
 }
 
 GtkWidget *
@@ -219,3 +249,61 @@ yesnobox(GtkWindow *parent, const char *fmt, ...)
 	return (-1);
 }
 
+struct yesno_s {
+	void	 (*cb)(int, gpointer);
+	gpointer data;
+};
+
+static void
+yesno_response(GtkDialog *dialog, gint response, gpointer data)
+{
+	int	       answer;
+	struct yesno_s *yn = (struct yesno_s *)data;
+
+	switch (response) {
+	case GTK_RESPONSE_YES:
+	case GTK_RESPONSE_ACCEPT:
+		answer = 1;
+		break;
+	case GTK_RESPONSE_NO:
+	case GTK_RESPONSE_REJECT:
+		answer = 0;
+		break;
+	default:
+		answer = -1;
+	}
+	gtk_widget_destroy(GTK_WIDGET(dialog));
+	yn->cb(answer, yn->data);
+	g_free(yn);
+}
+
+/*
+ * Like yesnobox(), but returns at once. When the user answers, 'cb' is
+ * called with the answer (1, 0, or -1 if the box was closed) and 'data'.
+ */
+void
+yesnobox_async(GtkWindow *parent, void (*cb)(int, gpointer), gpointer data,
+	const char *fmt, ...)
+{
+	char	       *str;
+	va_list	       ap;
+	GtkWidget      *dialog;
+	struct yesno_s *yn;
+
+	va_start(ap, fmt);
+	if ((str = g_strdup_vprintf(fmt, ap)) == NULL)
+		xerr(NULL, EXIT_FAILURE, "g_strdup_vprintf()");
+	va_end(ap);
+	yn = g_malloc(sizeof(struct yesno_s));
+	yn->cb = cb; yn->data = data;
+
+	dialog = gtk_message_dialog_new_with_markup(parent,
+                    GTK_DIALOG_DESTROY_WITH_PARENT, GTK_MESSAGE_QUESTION,
+                    GTK_BUTTONS_YES_NO, NULL);
+	gtk_message_dialog_set_markup(GTK_MESSAGE_DIALOG(dialog), str);
+	g_free(str);
+	gtk_window_set_modal(GTK_WINDOW(dialog), TRUE);
+	g_signal_connect(G_OBJECT(dialog), "response",
+	    G_CALLBACK(yesno_response), yn);
+	gtk_widget_show(dialog);
+}
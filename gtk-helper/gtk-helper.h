@@ -41,10 +41,13 @@
 #define ALIGN_BOTTOM 1.0
 
 extern int	 yesnobox(GtkWindow *, const char *, ...);
+extern void	 yesnobox_async(GtkWindow *, void (*)(int, gpointer), gpointer,
+		     const char *, ...);
 extern void	 xerr(GtkWindow *, int, const char *, ...);
 extern void	 xwarn(GtkWindow *, const char *, ...);
 extern void	 xerrx(GtkWindow *, int, const char *, ...);
 extern void	 xwarnx(GtkWindow *, const char *, ...);
+extern void	 set_xerr_hook(void (*)(void));
 extern char	 *gettext_wrapper(const char *);
 extern GtkWidget *new_label(float, float, const char *, ...);
 extern GtkWidget *new_pango_label(float, float, const char *, ...);